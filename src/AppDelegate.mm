@@ -11,6 +11,8 @@
 #import "NVRenderContext.h"
 #import "NVWindowController.h"
 
+#include <memory>
+#include <mutex>
 #include "log.h"
 #include "msgpack.hpp"
 #include "neovim.hpp"
@@ -31,16 +33,16 @@ static bool hasUnsavedChanges(NSArray<NVWindowController*> *windows) {
 
     for (NVWindowController *win in windows) {
         win.process->eval("len(filter(map(getbufinfo(), 'v:val.changed'), 'v:val'))", timeout,
-                          [&](const msg::object &error, const msg::object &result, bool timed_out) {
+                          nvim::typed_handler<uint64_t>([&](std::optional<uint64_t> changed) {
             // If we time out, or get an unexpected result, assume we have unsaved changes.
-            if (timed_out || !result.is<msg::integer>() || result.get<msg::integer>() != 0) {
+            if (!changed || *changed != 0) {
                 unsaved = true;
             }
 
             if (--windowsCount == 0) {
                 dispatch_semaphore_signal(semaphore);
             }
-        });
+        }));
     }
 
     dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
@@ -56,25 +58,67 @@ static bool hasUnsavedChanges(NSArray<NVWindowController*> *windows) {
 static NVWindowController* openWith(NSArray<NVWindowController*> *windows,
                                     const std::vector<std::string_view> &paths) {
     NSUInteger windowsCount = [windows count];
+
+    // With only one window there's nothing to choose between, don't bother
+    // asking Neovim how many of the files are open.
+    if (windowsCount == 1) {
+        return windows[0];
+    }
+
+    // Responses are handled on each window's IO queue. Once one window has
+    // every file open, there's no better candidate, so we stop waiting and
+    // cancel the other windows' requests. The state is shared with the
+    // handlers, as a handler may already be running when we return.
+    struct open_state {
+        std::mutex lock;
+        dispatch_semaphore_t semaphore;
+        NVWindowController *controller;
+        uint64_t mostOpen;
+        NSUInteger remaining;
+        bool signalled;
+    };
+
+    auto state = std::make_shared<open_state>();
+    state->semaphore = dispatch_semaphore_create(0);
+    state->controller = nil;
+    state->mostOpen = 0;
+    state->remaining = windowsCount;
+    state->signalled = false;
+
+    const uint64_t pathsCount = paths.size();
     dispatch_time_t timeout = dispatch_time(DISPATCH_TIME_NOW, 250 * NSEC_PER_MSEC);
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
-    NVWindowController *controller = nil;
-    uint64_t mostOpen = 0;
+    nvim::cancellation_token token = nvim::cancellation_token::make(timeout);
 
     for (NVWindowController *win in windows) {
-        win.process->open_count(paths, timeout, [&, win](const msg::object &error,
-                                                         const msg::object &result, bool timed_out) {
-            if (!timed_out && result.is<msg::integer>() && result.get<msg::integer>() > mostOpen) {
-                controller = win;
+        win.process->open_count(paths, timeout, nvim::typed_handler<uint64_t>([state, win, pathsCount](std::optional<uint64_t> open) {
+            std::lock_guard lock(state->lock);
+
+            if (open && *open > state->mostOpen) {
+                state->controller = win;
+                state->mostOpen = *open;
             }
 
-            if (--windowsCount == 0) {
-                dispatch_semaphore_signal(semaphore);
+            state->remaining -= 1;
+
+            if (!state->signalled && (state->remaining == 0 || state->mostOpen == pathsCount)) {
+                state->signalled = true;
+                dispatch_semaphore_signal(state->semaphore);
             }
-        });
+        }), token);
     }
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    dispatch_semaphore_wait(state->semaphore, DISPATCH_TIME_FOREVER);
+
+    for (NVWindowController *win in windows) {
+        win.process->cancel(token);
+    }
+
+    NVWindowController *controller = nil;
+
+    {
+        std::lock_guard lock(state->lock);
+        controller = state->controller;
+    }
 
     if (controller) {
         return controller;
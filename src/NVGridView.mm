@@ -10,6 +10,7 @@
 #import <QuartzCore/CAMetalLayer.h>
 #import <Metal/Metal.h>
 #import "NVGridView.h"
+#include "frame_builder.hpp"
 #include "shader_types.hpp"
 
 /// Utility class to help manage Metal buffers.
@@ -25,6 +26,8 @@ private:
     size_t capacity;
     std::atomic_flag in_use;
 
+    static constexpr size_t min_capacity = 1048576;
+
     static constexpr size_t align_up(size_t val, size_t alignment) {
         return (val + alignment - 1) & -alignment;
     }
@@ -52,18 +55,23 @@ public:
     ///
     /// If the existing buffer is on the same device, and is of sufficient
     /// length, it is reused. Otherwise a new buffer is allocated and the
-    /// existing buffer is freed. Calling this function invalidates any
-    /// previously allocated memory regions.
+    /// existing buffer is freed. Buffers are also reallocated if size is less
+    /// than a quarter of their capacity, so they shrink along with frames.
+    /// Calling this function invalidates any previously allocated memory
+    /// regions.
     void create(id<MTLDevice> device, size_t size) {
         length = 0;
 
-        if (buffer_device != device) {
-            buffer_device = device;
-            size = std::max(1048576ul, align_up(size, 8));
-        } else if (size <= capacity) {
+        if (buffer_device == device && size <= capacity &&
+            (size >= capacity / 4 || capacity <= min_capacity)) {
             return;
         }
 
+        // Leave some headroom, so that slowly growing frames don't cause a
+        // reallocation every frame.
+        buffer_device = device;
+        size = std::max(min_capacity, align_up(size + (size / 4), 8));
+
         buffer = [device newBufferWithLength:size
                                      options:MTLResourceStorageModeManaged |
                                              MTLResourceCPUCacheModeWriteCombined];
@@ -110,107 +118,6 @@ public:
     }
 };
 
-/// Adjusts the color attributes of cells under a block cursor.
-class AdjustedGrid {
-private:
-    struct Range {
-        const nvim::cell *begin;
-        int16_t rowBegin;
-        int16_t rowEnd;
-        int16_t colBegin;
-        int16_t colEnd;
-    };
-
-    nvim::cell adjustedCells[2];
-    Range ranges[4];
-    size_t rangesCount;
-
-public:
-    AdjustedGrid(const nvim::grid *grid, const nvim::cursor &cursor) {
-        ranges[0].begin = grid->begin();
-        ranges[0].rowBegin = 0;
-        ranges[0].colBegin = 0;
-
-        // If we're not dealing with a block cursor, no adjusments need to be
-        // made. We can iterate the grid in one swoop.
-        if (cursor.shape() != nvim::cursor_shape::block) {
-            rangesCount = 1;
-            ranges[0].rowEnd = grid->height();
-            ranges[0].colEnd = grid->width();
-            return;
-        }
-
-        // We need to adjust the cursor cells.
-        // Grid's are immutable, so we make a copy of the adjusted cells.
-        const nvim::cell *cursorCell = &cursor.cell();
-        size_t cursorWidth = cursor.width();
-
-        adjustedCells[0] = cursorCell[0].recolored(cursor.foreground(),
-                                                   cursor.background(),
-                                                   cursor.special());
-
-        if (cursorWidth == 2) {
-            adjustedCells[1] = cursorCell[1].recolored(cursor.foreground(),
-                                                       cursor.background(),
-                                                       cursor.special());
-        }
-
-        // When iterating over the grid, we need to swap out cursor cells with
-        // our adjusted cells. The iteration order required to do that is
-        // stored in an array of four Range objects.
-        rangesCount = 4;
-
-        // Start with full rows up until the cursor row.
-        ranges[0].rowEnd = cursor.row();
-        ranges[0].colEnd = grid->width();
-
-        // Iterate from the start over the cursor row till the cursor column.
-        ranges[1].begin    = cursorCell - cursor.col();
-        ranges[1].rowBegin = cursor.row();
-        ranges[1].rowEnd   = cursor.row() + 1;
-        ranges[1].colBegin = 0;
-        ranges[1].colEnd   = cursor.col();
-
-        // We're at the cursor cells. Iterate over the adjusted cells instead.
-        ranges[2].begin    = adjustedCells;
-        ranges[2].rowBegin = cursor.row();
-        ranges[2].rowEnd   = cursor.row() + 1;
-        ranges[2].colBegin = cursor.col();
-        ranges[2].colEnd   = cursor.col() + cursorWidth;
-
-        // Start from after the cursor cells and finish off the grid.
-        ranges[3].begin    = cursorCell + cursorWidth;
-        ranges[3].rowBegin = cursor.row();
-        ranges[3].rowEnd   = grid->height();
-        ranges[3].colBegin = cursor.col() + cursorWidth;
-        ranges[3].colEnd   = grid->width();
-    }
-
-    /// Iterate over the cursor adjusted grid.
-    /// Calls the function object callback once for every cell in ascending
-    /// order. The callback is invoked with three arguments:
-    ///   1. The cell's row (int16_t).
-    ///   2. The cell's column (int16_t).
-    ///   3. A const pointer to the cell (const nvim::cell*).
-    /// The return value of the callback is ignored.
-    template<typename Callable>
-    void forEach(Callable callback) {
-        for (size_t i=0; i<rangesCount; ++i) {
-            const Range &range = ranges[i];
-            const nvim::cell *cell = range.begin;
-            int16_t col = range.colBegin;
-
-            for (int16_t row = range.rowBegin; row < range.rowEnd; ++row) {
-                for (; col < range.colEnd; ++col, ++cell) {
-                    callback(row, col, cell);
-                }
-
-                col = 0;
-            }
-        }
-    }
-};
-
 @implementation NVGridView {
     CAMetalLayer *metalLayer;
 
@@ -227,14 +134,10 @@ public:
     mtlbuffer buffers[3];
     nvim::cursor cursor;
     const nvim::grid *grid;
+    frame_builder frameBuilder;
+    frame_metrics frameMetrics;
 
     NSSize backingCellSize;
-    simd_float2 cellSize;
-    simd_float2 baselineTranslate;
-    uint32_t cursorLineThickness;
-    line_metrics underline;
-    line_metrics undercurl;
-    line_metrics strikethrough;
 
     dispatch_source_t blinkTimer;
     bool blinkTimerActive;
@@ -267,6 +170,7 @@ public:
     glyphManager             = context.glyphManager;
 
     metalLayer.device = device;
+    frameBuilder.invalidate();
 }
 
 - (NVRenderContext *)renderContext {
@@ -296,8 +200,8 @@ public:
     CGSize drawableSize = [metalLayer drawableSize];
 
     nvim::grid_size size;
-    size.width  = drawableSize.width / cellSize.x;
-    size.height = drawableSize.height / cellSize.y;
+    size.width  = drawableSize.width / frameMetrics.cell_size.x;
+    size.height = drawableSize.height / frameMetrics.cell_size.y;
     return size;
 }
 
@@ -316,7 +220,8 @@ static void blinkCursorToggleOn(void *context);
     [self setNeedsDisplay:YES];
 
     grid = newGrid;
-    cursor = newGrid->cursor();
+    frameBuilder.set_grid(newGrid);
+    cursor = frameBuilder.cursor();
 
     // If we're not the main window:
     //   - The cursor blink loop should have already been stopped.
@@ -410,12 +315,12 @@ static void blinkCursorToggleOn(void *context) {
     CGFloat cellHeight = leading + descent + ascent;
     CGFloat cellWidth = floor(font.width() + 0.5);
 
-    cellSize.x = cellWidth;
-    cellSize.y = cellHeight;
+    frameMetrics.cell_size.x = cellWidth;
+    frameMetrics.cell_size.y = cellHeight;
     backingCellSize = [self convertSizeFromBacking:NSMakeSize(cellWidth, cellHeight)];
 
-    baselineTranslate.x = 0;
-    baselineTranslate.y = ascent;
+    frameMetrics.baseline.x = 0;
+    frameMetrics.baseline.y = ascent;
 
     CGFloat underlinePos = font.underline_position();
     uint16_t lineThickness = floor(font.underline_thickness() + 0.5);
@@ -427,19 +332,21 @@ static void blinkCursorToggleOn(void *context) {
         underlineTranslate = floor(underlinePos - 0.5);
     }
 
-    strikethrough.period = 0;
-    strikethrough.thickness = lineThickness;
-    strikethrough.ytranslate = ascent / 3;
+    frameMetrics.strikethrough.period = 0;
+    frameMetrics.strikethrough.thickness = lineThickness;
+    frameMetrics.strikethrough.ytranslate = ascent / 3;
+
+    frameMetrics.underline.period = 0;
+    frameMetrics.underline.thickness = lineThickness;
+    frameMetrics.underline.ytranslate = underlineTranslate;
 
-    underline.period = 0;
-    underline.thickness = lineThickness;
-    underline.ytranslate = underlineTranslate;
+    frameMetrics.undercurl.period = 2 * font.scale_factor();
+    frameMetrics.undercurl.thickness = 2 * font.scale_factor();
+    frameMetrics.undercurl.ytranslate = underlineTranslate;
 
-    undercurl.period = 2 * font.scale_factor();
-    undercurl.thickness = 2 * font.scale_factor();
-    undercurl.ytranslate = underlineTranslate;
+    frameMetrics.cursor_line_width = 1 * font.scale_factor();
+    frameBuilder.invalidate();
 
-    cursorLineThickness = 1 * font.scale_factor();
     [metalLayer setContentsScale:font.scale_factor()];
 }
 
@@ -459,18 +366,23 @@ static void blinkCursorToggleOn(void *context) {
         return;
     }
 
-    // Allocate enough memory for the worst case scenario, where every cell has
-    // a glyph, a strikethrough, and an underline / undercurl. It takes two
-    // line_data objects to handle a cell with both a strikethrough and an
-    // underline / undercurl.
-    //
-    // We're using a lot of memory to handle our line data, but most grids have
-    // very few lines. Maybe this could be reworked.
-    const size_t gridSize = grid->cells_size();
+    simd_float2 drawableSizeFloat = simd_make_float2(drawableSize.width,
+                                                     drawableSize.height);
+
+    frame_counts counts = frameBuilder.build(cursor, drawableSizeFloat, frameMetrics,
+                                             glyphManager->generation(),
+                                             [&](const nvim::cell &cell) {
+        return glyphManager->find(fontFamily, cell);
+    }, [&](const nvim::cell &cell) {
+        return glyphManager->get(fontFamily, cell);
+    });
+
+    // Frames are built before they're written, so we allocate exactly as much
+    // memory as the frame needs.
     const size_t uniformBufferSize    = sizeof(uniform_data);
-    const size_t backgroundBufferSize = gridSize * sizeof(uint32_t);
-    const size_t glyphBufferSize      = gridSize * sizeof(glyph_data);
-    const size_t lineBufferSize       = gridSize * sizeof(line_data) * 2;
+    const size_t backgroundBufferSize = counts.backgrounds * sizeof(background_data);
+    const size_t glyphBufferSize      = counts.glyphs * sizeof(glyph_data);
+    const size_t lineBufferSize       = counts.lines * sizeof(line_data);
 
     // Pad to account for over allocations caused by alignment.
     const size_t bufferSize = (256 * 4) + uniformBufferSize
@@ -484,65 +396,15 @@ static void blinkCursorToggleOn(void *context) {
     auto glyphBuffer      = buffer.allocate(glyphBufferSize);
     auto lineBuffer       = buffer.allocate(lineBufferSize);
 
-    auto uniforms    = static_cast<uniform_data*>(uniformBuffer.ptr);
-    auto backgrounds = static_cast<uint32_t*>(backgroundBuffer.ptr);
-    auto glyphs      = static_cast<glyph_data*>(glyphBuffer.ptr);
-    auto lines       = static_cast<line_data*>(lineBuffer.ptr);
-
-    const simd_float2 pixelSize = simd_make_float2(2.0, -2.0) /
-                                  simd_make_float2(drawableSize.width, drawableSize.height);
-
-    uniforms->pixel_size        = pixelSize;
-    uniforms->cell_pixel_size   = cellSize;
-    uniforms->cell_size         = cellSize * pixelSize;
-    uniforms->baseline          = baselineTranslate;
-    uniforms->grid_width        = static_cast<uint32_t>(grid->width());
-    uniforms->cursor_position   = simd_make_short2(cursor.col(), cursor.row());
-    uniforms->cursor_color      = cursor.background();
-    uniforms->cursor_line_width = cursorLineThickness;
-    uniforms->cursor_cell_width = cursor.width();
-
-    glyph_data *glyphsBegin = glyphs;
-    line_data *linesBegin = lines;
-    simd_short2 undercurlNext = simd_make_short2(-1, -1);
-    uint16_t undercurlPosition = 0;
-
-    AdjustedGrid(grid, cursor).forEach([&](int16_t row, int16_t col, const nvim::cell *cell) {
-        simd_short2 gridpos = simd_make_short2(col, row);
-        *backgrounds++ = cell->background();
-
-        if (cell->has_line_emphasis()) {
-            nvim::rgb_color color = cell->special();
-
-            // Undercurls and underlines are mutually exclusive. We'll make
-            // undercurls take priority, they usually represent errors,
-            // so users won't appreciate them being hidden.
-            if (cell->has_undercurl()) {
-                if (simd_equal(undercurlNext, gridpos)) {
-                    undercurlPosition += 1;
-                } else {
-                    undercurlPosition = 0;
-                }
-
-                undercurlNext = simd_make_short2(col + 1, row);
-                *lines++ = line_data(gridpos, color, undercurl, undercurlPosition);
-            } else if (cell->has_underline()) {
-                *lines++ = line_data(gridpos, color, underline);
-            }
-
-            if (cell->has_strikethrough()) {
-                *lines++ = line_data(gridpos, color, strikethrough);
-            }
-        }
-
-        if (!cell->empty()) {
-            glyph_rect glyph = glyphManager->get(fontFamily, *cell);
-            *glyphs++ = glyph_data(gridpos, cell->width(), glyph);
-        }
-    });
+    frame_buffers frameBuffers;
+    frameBuffers.uniforms    = static_cast<uniform_data*>(uniformBuffer.ptr);
+    frameBuffers.backgrounds = static_cast<background_data*>(backgroundBuffer.ptr);
+    frameBuffers.glyphs      = static_cast<glyph_data*>(glyphBuffer.ptr);
+    frameBuffers.lines       = static_cast<line_data*>(lineBuffer.ptr);
+    frameBuilder.write(frameBuffers);
 
-    size_t glyphsCount = glyphs - glyphsBegin;
-    size_t linesCount = lines - linesBegin;
+    size_t glyphsCount = counts.glyphs;
+    size_t linesCount = counts.lines;
     buffer.update(0, glyphBuffer.offset + (sizeof(glyph_data) * glyphsCount));
 
     id<CAMetalDrawable> drawable = [metalLayer nextDrawable];
@@ -561,7 +423,7 @@ static void blinkCursorToggleOn(void *context) {
     [commandEncoder drawPrimitives:MTLPrimitiveTypeTriangleStrip
                        vertexStart:0
                        vertexCount:4
-                     instanceCount:gridSize];
+                     instanceCount:counts.backgrounds];
 
     if (glyphsCount) {
         [commandEncoder setRenderPipelineState:glyphRenderPipeline];
@@ -613,7 +475,7 @@ static void blinkCursorToggleOn(void *context) {
             break;
 
         case nvim::cursor_shape::block:
-            break; // Block cursors are handled with AdjustedGrids.
+            break; // Block cursors are handled by the frame builder.
     }
 
     [commandEncoder endEncoding];
@@ -37,9 +37,9 @@ NS_ASSUME_NONNULL_BEGIN
 /// A handle to the Neovim process.
 - (nvim::process *)process;
 
-/// Connect to a remote Neovim instance via a Unix domain socket.
+/// Connect to a remote Neovim instance via a Unix domain or TCP socket.
 /// If a connection is successfully established, the window is displayed.
-/// @param addr Path to the Unix domain socket.
+/// @param addr Path to the Unix domain socket, or a TCP address (host:port).
 /// @returns Zero on success, otherwise an errno error code.
 - (int)connect:(NSString *)addr;
 
@@ -57,6 +57,8 @@ static NSMutableArray<NVWindowController*> *neovimWindows = [[NSMutableArray all
     BOOL shouldCenter;
     BOOL isOpen;
     BOOL isAlive;
+    BOOL extCmdline;
+    BOOL extMessages;
     uint64_t isLiveResizing;
 }
 
@@ -233,8 +235,8 @@ static inline NSSize minGridViewSize(NSSize cellSize) {
 /// the guifont option exist, the font descriptor is NULL.
 static std::pair<arc_ptr<CTFontDescriptorRef>, CGFloat> getFontDescriptor(nvim::process &nvim) {
     CGFloat defaultSize = [NSFont systemFontSize];
-    std::string guifont = nvim.get_guifont();
-    std::vector<nvim::font> fonts = nvim::parse_guifont(guifont, defaultSize);
+    nvim::option_reader options = nvim.read_options();
+    std::vector<nvim::font> fonts = nvim::parse_guifont(options.guifont(), defaultSize);
 
     for (auto [name, size] : fonts) {
         arc_ptr descriptor = font_manager::make_descriptor(name);
@@ -248,7 +250,7 @@ static std::pair<arc_ptr<CTFontDescriptorRef>, CGFloat> getFontDescriptor(nvim::
         std::string error;
         error.reserve(512);
         error.append("Error: Invalid font(s): guifont=");
-        error.append(guifont);
+        error.append(options.guifont());
         nvim.error_writeln(error);
     }
 
@@ -373,6 +375,19 @@ static std::pair<arc_ptr<CTFontDescriptorRef>, CGFloat> getFontDescriptor(nvim::
 }
 
 - (void)attach {
+    // The external command line and messages are opt in.
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    extMessages = [defaults boolForKey:@"NVExternalMessages"];
+    extCmdline = extMessages || [defaults boolForKey:@"NVExternalCmdline"];
+    nvim.set_ui_extensions(extCmdline, extMessages);
+
+    // Redraw event tracing is opt in, it's used to diagnose slow redraws.
+    NSInteger slowRedrawMicroseconds = [defaults integerForKey:@"NVTraceSlowRedrawEvents"];
+
+    if (slowRedrawMicroseconds > 0) {
+        nvim.trace_redraw_events(true, slowRedrawMicroseconds * NSEC_PER_USEC);
+    }
+
     dispatch_time_t timeout = dispatch_time(DISPATCH_TIME_NOW, 1 * NSEC_PER_SEC);
     nvim.ui_attach_wait(lastGridSize.width, lastGridSize.height, timeout);
 
@@ -685,6 +700,11 @@ static inline bool pointInGrid(nvim::grid_point point, nvim::grid_size size) {
            point.column >= 0 && point.column < size.width;
 }
 
+/// Maps a location in the grid view to a location in a Neovim grid.
+- (nvim::grid_location)gridLocation:(nvim::grid_point)location {
+    return gridView.grid->locate(location.row, location.column);
+}
+
 - (void)mouseDown:(NSEvent *)event button:(MouseButton)button {
     nvim::grid_point location = [gridView cellLocation:event.locationInWindow];
 
@@ -695,7 +715,7 @@ static inline bool pointInGrid(nvim::grid_point point, nvim::grid_size size) {
 
     lastMouseLocation[button] = location;
     input_modifiers modifiers = input_modifiers(event.modifierFlags);
-    nvim.input_mouse(buttonName(button), "press", modifiers, location.row, location.column);
+    nvim.input_mouse(buttonName(button), "press", modifiers, [self gridLocation:location]);
 }
 
 - (void)mouseDragged:(NSEvent *)event button:(MouseButton)button {
@@ -709,7 +729,7 @@ static inline bool pointInGrid(nvim::grid_point point, nvim::grid_size size) {
 
     if (location != lastLocation) {
         input_modifiers modifiers = input_modifiers(event.modifierFlags);
-        nvim.input_mouse(buttonName(button), "drag", modifiers, location.row, location.column);
+        nvim.input_mouse(buttonName(button), "drag", modifiers, [self gridLocation:location]);
         lastLocation = location;
     }
 }
@@ -723,7 +743,7 @@ static inline bool pointInGrid(nvim::grid_point point, nvim::grid_size size) {
     nvim::grid_point location = [gridView cellLocation:windowLocation clampTo:lastGridSize];
 
     input_modifiers modifiers = input_modifiers(event.modifierFlags);
-    nvim.input_mouse(buttonName(button), "release", modifiers, location.row, location.column);
+    nvim.input_mouse(buttonName(button), "release", modifiers, [self gridLocation:location]);
 }
 
 - (void)mouseDown:(NSEvent *)event {
@@ -763,9 +783,9 @@ static inline bool pointInGrid(nvim::grid_point point, nvim::grid_size size) {
 }
 
 static void scrollEvent(nvim::process &nvim, size_t count, std::string_view direction,
-                        std::string_view modifiers, nvim::grid_point location) {
+                        std::string_view modifiers, nvim::grid_location location) {
     for (size_t i=0; i<count; ++i) {
-        nvim.input_mouse("wheel", direction, modifiers, location.row, location.column);
+        nvim.input_mouse("wheel", direction, modifiers, location);
     }
 }
 
@@ -816,17 +836,18 @@ static void scrollEvent(nvim::process &nvim, size_t count, std::string_view dire
     }
 
     input_modifiers modifiers = input_modifiers(modifierFlags);
+    nvim::grid_location target = [self gridLocation:location];
 
     if (deltaY > 0) {
-        scrollEvent(nvim, deltaY, "up", modifiers, location);
+        scrollEvent(nvim, deltaY, "up", modifiers, target);
     } else if (deltaY < 0) {
-        scrollEvent(nvim, -deltaY, "down", modifiers, location);
+        scrollEvent(nvim, -deltaY, "down", modifiers, target);
     }
 
     if (deltaX > 0) {
-        scrollEvent(nvim, deltaX, "left", modifiers, location);
+        scrollEvent(nvim, deltaX, "left", modifiers, target);
     } else if (deltaX < 0) {
-        scrollEvent(nvim, -deltaX, "right", modifiers, location);
+        scrollEvent(nvim, -deltaX, "right", modifiers, target);
     }
 }
 
@@ -1192,7 +1213,8 @@ static std::string joinURLs(NSArray<NSURL*> *urls, char delim) {
 }
 
 - (void)titleDidChange {
-    std::string title = nvim.get_title();
+    nvim::option_reader options = nvim.read_options();
+    std::string_view title = options.title();
     NSString *nstitle = [[NSString alloc] initWithBytes:title.data()
                                                  length:title.size()
                                                encoding:NSUTF8StringEncoding];
@@ -1212,13 +1234,13 @@ static std::string joinURLs(NSArray<NSURL*> *urls, char delim) {
 }
 
 - (void)optionsDidChange {
-    static constexpr nvim::options expected = {
-        .ext_cmdline    = false,
+    const nvim::options expected = {
+        .ext_cmdline    = (bool)extCmdline,
         .ext_hlstate    = false,
         .ext_linegrid   = true,
-        .ext_messages   = false,
-        .ext_multigrid  = false,
-        .ext_popupmenu  = false,
+        .ext_messages   = (bool)extMessages,
+        .ext_multigrid  = true,
+        .ext_popupmenu  = true,
         .ext_tabline    = false,
         .ext_termcolors = false
     };
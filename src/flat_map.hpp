@@ -0,0 +1,273 @@
+//
+//  Neovim Mac
+//  flat_map.hpp
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#ifndef FLAT_MAP_HPP
+#define FLAT_MAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/// An open addressing hash map that stores keys and values inline.
+///
+/// Slots are split into groups of eight. Each slot has a control byte that is
+/// either empty, or holds seven bits of the key's hash. A lookup hashes the
+/// key to a group, and compares the hash fragment against all eight control
+/// bytes of the group at once, only comparing keys when a fragment matches.
+/// Groups are probed in triangular order until a group with an empty slot is
+/// found.
+///
+/// Lookups touch one or two cache lines, and never chase pointers. The trade
+/// off is that elements can't be erased individually. Maps are cleared, or
+/// rebuilt with insert_unique(), which skips key comparisons.
+///
+/// Keys and values must be trivially copyable.
+template<typename Key, typename Value, typename Hash, typename Equal>
+class flat_map {
+private:
+    static_assert(std::is_trivially_copyable_v<Key>);
+    static_assert(std::is_trivially_copyable_v<Value>);
+
+    struct slot {
+        Key key;
+        Value value;
+    };
+
+    struct alignas(slot) slot_storage {
+        unsigned char bytes[sizeof(slot)];
+    };
+
+    static constexpr size_t group_width = 8;
+    static constexpr size_t min_capacity = 16;
+    static constexpr uint8_t empty = 0x80;
+    static constexpr uint64_t lsbs = 0x0101010101010101ull;
+    static constexpr uint64_t msbs = 0x8080808080808080ull;
+
+    std::unique_ptr<uint8_t[]> control;
+    std::unique_ptr<slot_storage[]> slots;
+    size_t capacity_;
+    size_t size_;
+    size_t max_size;
+    Hash hasher;
+    Equal equal;
+
+    struct hash_parts {
+        size_t group;
+        uint8_t fragment;
+    };
+
+    // Mixes the hash, as user hashes may be optimized for speed over quality.
+    // The folded low bits pick the group, the top seven bits are the fragment.
+    hash_parts split(const Key &key) const {
+        uint64_t hash = static_cast<uint64_t>(hasher(key)) * 0x9e3779b97f4a7c15ull;
+        hash_parts parts;
+        parts.group = (hash ^ (hash >> 32)) & ((capacity_ / group_width) - 1);
+        parts.fragment = static_cast<uint8_t>(hash >> 57);
+        return parts;
+    }
+
+    uint64_t load_group(size_t group) const {
+        uint64_t bytes;
+        memcpy(&bytes, control.get() + (group * group_width), sizeof(bytes));
+        return bytes;
+    }
+
+    // Returns a mask with the high bit set for each byte equal to fragment.
+    // May report false positives following a true match, which is fine as
+    // matches are always confirmed by comparing keys.
+    static uint64_t match_fragment(uint64_t group, uint8_t fragment) {
+        uint64_t bytes = group ^ (lsbs * fragment);
+        return (bytes - lsbs) & ~bytes & msbs;
+    }
+
+    static uint64_t match_empty(uint64_t group) {
+        return group & msbs;
+    }
+
+    // The index within a group of the lowest byte set in mask.
+    static size_t first_index(uint64_t mask) {
+        return __builtin_ctzll(mask) / 8;
+    }
+
+    slot* get_slot(size_t index) const {
+        return std::launder(reinterpret_cast<slot*>(&slots[index]));
+    }
+
+    // Inserts key and value in the first empty slot of key's probe sequence.
+    Value* insert_new(const Key &key, const Value &value) {
+        auto [group, fragment] = split(key);
+        const size_t group_mask = (capacity_ / group_width) - 1;
+
+        for (size_t probe = 1;; ++probe) {
+            if (uint64_t empties = match_empty(load_group(group))) {
+                size_t index = (group * group_width) + first_index(empties);
+                control[index] = fragment;
+                size_ += 1;
+                return &(new (&slots[index]) slot{key, value})->value;
+            }
+
+            group = (group + probe) & group_mask;
+        }
+    }
+
+    void allocate(size_t capacity) {
+        capacity_ = capacity;
+        size_ = 0;
+        max_size = capacity - (capacity / group_width);
+        control = std::make_unique<uint8_t[]>(capacity);
+        slots = std::make_unique<slot_storage[]>(capacity);
+        memset(control.get(), empty, capacity);
+    }
+
+    void rehash(size_t capacity) {
+        std::unique_ptr<uint8_t[]> old_control = std::move(control);
+        std::unique_ptr<slot_storage[]> old_slots = std::move(slots);
+        size_t old_capacity = capacity_;
+        allocate(capacity);
+
+        for (size_t i=0; i<old_capacity; ++i) {
+            if (old_control[i] != empty) {
+                slot *old = std::launder(reinterpret_cast<slot*>(&old_slots[i]));
+                insert_new(old->key, old->value);
+            }
+        }
+    }
+
+public:
+    flat_map(): capacity_(0), size_(0), max_size(0) {}
+
+    flat_map(flat_map &&other):
+        control(std::move(other.control)),
+        slots(std::move(other.slots)),
+        capacity_(other.capacity_),
+        size_(other.size_),
+        max_size(other.max_size) {
+        other.capacity_ = 0;
+        other.size_ = 0;
+        other.max_size = 0;
+    }
+
+    flat_map& operator=(flat_map &&other) {
+        if (this != &other) {
+            control = std::move(other.control);
+            slots = std::move(other.slots);
+            capacity_ = other.capacity_;
+            size_ = other.size_;
+            max_size = other.max_size;
+            other.capacity_ = 0;
+            other.size_ = 0;
+            other.max_size = 0;
+        }
+
+        return *this;
+    }
+
+    /// The number of elements in the map.
+    size_t size() const {
+        return size_;
+    }
+
+    /// The number of slots in the map.
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    /// Ensures count elements can be inserted without a rehash.
+    void reserve(size_t count) {
+        size_t capacity = capacity_ ? capacity_ : min_capacity;
+
+        while (capacity - (capacity / group_width) < count) {
+            capacity *= 2;
+        }
+
+        if (capacity != capacity_) {
+            rehash(capacity);
+        }
+    }
+
+    /// Removes all elements. The map's capacity is unchanged.
+    void clear() {
+        if (size_) {
+            memset(control.get(), empty, capacity_);
+            size_ = 0;
+        }
+    }
+
+    /// Returns a pointer to the value mapped to key, or null if key is not in
+    /// the map. The pointer is invalidated by the next insertion.
+    Value* find(const Key &key) const {
+        if (!size_) {
+            return nullptr;
+        }
+
+        auto [group, fragment] = split(key);
+        const size_t group_mask = (capacity_ / group_width) - 1;
+
+        for (size_t probe = 1;; ++probe) {
+            uint64_t bytes = load_group(group);
+            uint64_t matches = match_fragment(bytes, fragment);
+
+            while (matches) {
+                size_t index = (group * group_width) + first_index(matches);
+                slot *candidate = get_slot(index);
+
+                if (control[index] == fragment && equal(candidate->key, key)) {
+                    return &candidate->value;
+                }
+
+                matches &= matches - 1;
+            }
+
+            if (match_empty(bytes)) {
+                return nullptr;
+            }
+
+            group = (group + probe) & group_mask;
+        }
+    }
+
+    /// Maps key to value, replacing any existing value.
+    /// @returns A pointer to the inserted value.
+    Value* insert(const Key &key, const Value &value) {
+        if (Value *existing = find(key)) {
+            *existing = value;
+            return existing;
+        }
+
+        return insert_unique(key, value);
+    }
+
+    /// Maps key to value.
+    /// Precondition: key is not in the map.
+    /// @returns A pointer to the inserted value.
+    Value* insert_unique(const Key &key, const Value &value) {
+        if (size_ >= max_size) {
+            reserve(size_ + 1);
+        }
+
+        return insert_new(key, value);
+    }
+
+    /// Calls callback(const Key&, const Value&) for every element.
+    template<typename Callable>
+    void for_each(Callable callback) const {
+        for (size_t i=0; i<capacity_; ++i) {
+            if (control[i] != empty) {
+                slot *element = get_slot(i);
+                callback(element->key, element->value);
+            }
+        }
+    }
+};
+
+#endif // FLAT_MAP_HPP
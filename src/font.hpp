@@ -12,10 +12,10 @@
 
 #include <simd/simd.h>
 #include <Metal/Metal.h>
-#include <unordered_map>
 #include <memory>
 #include <vector>
 #include <string>
+#include "flat_map.hpp"
 #include "shader_types.hpp"
 #include "ui.hpp"
 
@@ -436,16 +436,14 @@ private:
         }
     };
 
-    using glyph_map = std::unordered_map<key_type,
-                                         glyph_rect,
-                                         key_hash,
-                                         key_equal>;
+    using glyph_map = flat_map<key_type, glyph_rect, key_hash, key_equal>;
 
     size_t evict_threshold;
     size_t evict_preserve;
     glyph_rasterizer *rasterizer;
     glyph_texture_cache texture_cache;
     glyph_map map;
+    uint64_t evictions = 0;
 
     void do_evict();
 
@@ -483,8 +481,8 @@ public:
                    nvim::rgb_color foreground) {
         key_type key(font, cell.grapheme(), background, foreground);
 
-        if (auto iter = map.find(key); iter != map.end()) {
-            return iter->second;
+        if (const glyph_rect *cached = map.find(key)) {
+            return *cached;
         }
 
         glyph_bitmap glyph = rasterizer->rasterize(font,
@@ -501,7 +499,7 @@ public:
         cached.size.x = glyph.width;
         cached.size.y = glyph.height;
 
-        map.emplace(key, cached);
+        map.insert_unique(key, cached);
         return cached;
     }
 
@@ -511,6 +509,24 @@ public:
         return get(font, cell, cell.background(), cell.foreground());
     }
 
+    /// Returns the cached glyph for cell, using its background and foreground
+    /// colors, or null if the glyph isn't cached. Never modifies the cache, so
+    /// it's safe to call from multiple threads, provided no other member
+    /// functions are called concurrently. The returned pointer is invalidated
+    /// by the next call to get() or evict().
+    const glyph_rect* find(const font_family &font_family,
+                           const nvim::cell &cell) const {
+        CTFontRef font = font_family.get(cell.font_attributes());
+        key_type key(font, cell.grapheme(), cell.background(), cell.foreground());
+        return map.find(key);
+    }
+
+    /// Returns a count that changes whenever previously returned glyph_rects
+    /// are invalidated by an eviction.
+    uint64_t generation() const {
+        return evictions;
+    }
+
     /// Returns the Metal texture containing the cached glyphs.
     id<MTLTexture> texture() const {
         return texture_cache.metal_texture();
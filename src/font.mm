@@ -383,21 +383,26 @@ void glyph_manager::do_evict() {
     if (evicted == 0) {
         if (evict_preserve == 0) {
             map.clear();
+            evictions += 1;
         }
 
         return;
     }
 
+    evictions += 1;
+
+    // Surviving glyphs are reinserted without key comparisons, each key is
+    // already unique.
     glyph_map new_map;
     new_map.reserve(map.size());
 
-    for (const auto& [key, value] : map) {
+    map.for_each([&](const key_type &key, const glyph_rect &value) {
         if (value.texture_origin.z >= evicted) {
             auto shifted = value;
             shifted.texture_origin.z -= evicted;
-            new_map.emplace(key, shifted);
+            new_map.insert_unique(key, shifted);
         }
-    }
+    });
 
     map = std::move(new_map);
 }
@@ -0,0 +1,739 @@
+//
+//  Neovim Mac
+//  frame_builder.cpp
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include "frame_builder.hpp"
+
+using code_point_range = std::pair<char32_t, char32_t>;
+
+// East Asian Wide and Fullwidth code points, and emoji, which Neovim displays
+// in two cells. Sorted, inclusive ranges.
+static constexpr code_point_range wide_ranges[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+    {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+    {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+    {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+    {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE3},
+    {0x17000, 0x18AFF}, {0x1B000, 0x1B16F}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F202}, {0x1F210, 0x1F23B}, {0x1F240, 0x1F248},
+    {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F64F},
+    {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F900, 0x1F9FF},
+    {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+// Combining marks, joiners, and variation selectors. Neovim displays these in
+// the same cell as the code point they follow.
+static constexpr code_point_range combining_ranges[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x0610, 0x061A},
+    {0x064B, 0x065F}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E},
+    {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200D, 0x200D}, {0x20D0, 0x20FF},
+    {0x3099, 0x309A}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xE0100, 0xE01EF}
+};
+
+template<size_t size>
+static bool in_ranges(const code_point_range (&ranges)[size], char32_t c) {
+    auto iter = std::upper_bound(std::begin(ranges), std::end(ranges), c,
+                                 [](char32_t c, const code_point_range &range) {
+        return c < range.first;
+    });
+
+    return iter != std::begin(ranges) && c <= std::prev(iter)->second;
+}
+
+/// Decodes the UTF-8 code point starting at text[index], and advances index
+/// past it. Invalid bytes are decoded as themselves.
+static char32_t decode(std::string_view text, size_t &index) {
+    size_t start = index;
+    unsigned char lead = text[index++];
+    size_t length = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+    char32_t c = length ? lead & (0x3F >> length) : lead;
+
+    for (size_t i=0; i<length; ++i) {
+        if (index == text.size() || (text[index] & 0xC0) != 0x80) {
+            index = start + 1;
+            return lead;
+        }
+
+        c = (c << 6) | (text[index++] & 0x3F);
+    }
+
+    return c;
+}
+
+/// Finds the end of the grapheme starting at text[begin], as Neovim splits
+/// text into cells. The grapheme's width in cells is stored in width.
+static size_t next_grapheme(std::string_view text, size_t begin, size_t &width) {
+    size_t end = begin;
+    char32_t c = decode(text, end);
+    width = in_ranges(wide_ranges, c) ? 2 : 1;
+
+    while (end < text.size()) {
+        size_t next = end;
+
+        if (!in_ranges(combining_ranges, decode(text, next))) {
+            break;
+        }
+
+        end = next;
+    }
+
+    return end;
+}
+
+/// The number of cells needed to display text.
+static size_t display_width(std::string_view text) {
+    size_t total = 0;
+
+    for (size_t begin=0; begin<text.size();) {
+        size_t width;
+        begin = next_grapheme(text, begin, width);
+        total += width;
+    }
+
+    return total;
+}
+
+void grid_overlay::reset(const nvim::grid *overlay_grid,
+                         long row, long col, long columns) {
+    cells.clear();
+    grid = overlay_grid;
+    top = row;
+    left = col;
+    width = columns;
+    height = 0;
+    row_begin = 0;
+}
+
+void grid_overlay::append(std::string_view text, size_t field_width, uint16_t hlid) {
+    size_t begin = 0;
+    size_t columns = 0;
+
+    while (columns < field_width) {
+        if (begin == text.size()) {
+            cells.push_back(grid->make_cell(" ", hlid));
+            columns += 1;
+            continue;
+        }
+
+        size_t width;
+        size_t end = next_grapheme(text, begin, width);
+
+        // Double width graphemes that don't fit are replaced with padding.
+        if (columns + width > field_width) {
+            begin = text.size();
+            continue;
+        }
+
+        cells.push_back(grid->make_cell(text.substr(begin, end - begin),
+                                        hlid, width));
+
+        // Like grid_line, the right half of a double width grapheme is an
+        // empty cell.
+        if (width == 2) {
+            cells.push_back(grid->make_cell("", hlid));
+        }
+
+        columns += width;
+        begin = end;
+    }
+}
+
+void grid_overlay::append(std::string_view text, uint16_t hlid) {
+    size_t space = width - std::min<size_t>(row_size(), width);
+    append(text, std::min(display_width(text), space), hlid);
+}
+
+void grid_overlay::pad_row(size_t columns, uint16_t hlid) {
+    size_t size = row_size();
+
+    if (size > columns) {
+        cells.resize(row_begin + columns);
+
+        // Don't leave the left half of a double width grapheme behind.
+        if (columns && cells.back().width() == 2) {
+            cells.back() = grid->make_cell(" ", hlid);
+        }
+    } else {
+        append("", columns - size, hlid);
+    }
+}
+
+void grid_overlay::end_row(uint16_t hlid) {
+    pad_row(width, hlid);
+    row_begin = cells.size();
+    height += 1;
+}
+
+/// Lays out grid's popup menu below or above its anchor position.
+static void layout_popupmenu(grid_overlay &overlay, const nvim::grid *grid) {
+    const nvim::popupmenu &pum = grid->popupmenu();
+    overlay.clear();
+
+    if (!pum.visible()) {
+        return;
+    }
+
+    const long grid_width = grid->width();
+    const long grid_height = grid->height();
+    const long item_count = pum.size();
+    long anchor_row = pum.row();
+    long anchor_col = pum.col();
+
+    // Command line completion menus are drawn above the command line.
+    if (pum.grid() == -1) {
+        anchor_row = grid_height - 1;
+    } else {
+        for (const nvim::grid_window &window : grid->windows()) {
+            if ((long)window.grid == pum.grid()) {
+                anchor_row += window.row;
+                anchor_col += window.col;
+                break;
+            }
+        }
+    }
+
+    long rows_below = grid_height - anchor_row - 1;
+    long rows_above = anchor_row;
+    bool below = pum.grid() != -1 && (rows_below >= item_count ||
+                                      rows_below >= rows_above);
+
+    long rows = std::min(item_count, below ? rows_below : rows_above);
+
+    if (rows <= 0 || grid_width <= 0) {
+        return;
+    }
+
+    size_t word_width = 0;
+    size_t kind_width = 0;
+    size_t menu_width = 0;
+
+    for (long i=0; i<item_count; ++i) {
+        word_width = std::max(word_width, display_width(pum[i].word));
+        kind_width = std::max(kind_width, display_width(pum[i].kind));
+        menu_width = std::max(menu_width, display_width(pum[i].menu));
+    }
+
+    // Items are drawn as " word kind menu ", with a scrollbar if not every
+    // item fits.
+    bool scrollbar = item_count > rows;
+    long text_columns = 1 + word_width + (kind_width ? kind_width + 1 : 0) +
+                                         (menu_width ? menu_width + 1 : 0) + 1;
+    long columns = std::min(text_columns + scrollbar, grid_width);
+    text_columns = columns - scrollbar;
+
+    long selected = pum.selected();
+    long first = selected >= rows ? selected - rows + 1 : 0;
+    long thumb_height = std::max(1l, (rows * rows) / item_count);
+    long thumb_top = std::min((first * rows) / item_count, rows - thumb_height);
+
+    overlay.reset(grid, below ? anchor_row + 1 : anchor_row - rows,
+                  std::clamp(anchor_col - 1, 0l, grid_width - columns), columns);
+
+    for (long row=0; row<rows; ++row) {
+        long index = first + row;
+        const nvim::popupmenu_item &item = pum[index];
+        uint16_t hlid = index == selected ? pum.selected_hl_id() :
+                                            pum.normal_hl_id();
+
+        overlay.append(" ", 1, hlid);
+        overlay.append(item.word, word_width, hlid);
+
+        if (kind_width) {
+            overlay.append(" ", 1, hlid);
+            overlay.append(item.kind, kind_width, hlid);
+        }
+
+        if (menu_width) {
+            overlay.append(" ", 1, hlid);
+            overlay.append(item.menu, menu_width, hlid);
+        }
+
+        overlay.append(" ", 1, hlid);
+        overlay.pad_row(text_columns, hlid);
+
+        if (scrollbar) {
+            bool thumb = row >= thumb_top && row < thumb_top + thumb_height;
+            overlay.append(" ", 1, thumb ? pum.thumb_hl_id() :
+                                           pum.scrollbar_hl_id());
+        }
+
+        overlay.end_row(hlid);
+    }
+}
+
+/// A line of highlighted text, drawn in an overlay.
+using overlay_line = std::vector<std::pair<std::string_view, uint16_t>>;
+
+/// Appends text to lines, starting a new line after each newline.
+static void append_lines(std::vector<overlay_line> &lines,
+                         const nvim::styled_text &text) {
+    lines.emplace_back();
+
+    for (const nvim::text_chunk &chunk : text) {
+        std::string_view remaining = chunk.text;
+
+        for (;;) {
+            size_t newline = remaining.find('\n');
+            lines.back().emplace_back(remaining.substr(0, newline), chunk.hlid);
+
+            if (newline == std::string_view::npos) {
+                break;
+            }
+
+            remaining.remove_prefix(newline + 1);
+            lines.emplace_back();
+        }
+    }
+}
+
+/// Lays out the command line, and messages above it, over the last rows of
+/// the grid. When the command line is hidden, the last row shows the mode,
+/// command, and ruler indicators, if there are any.
+/// @returns True if the cursor is on the command line, in which case
+///          cursor_position is set to the cursor's grid position.
+static bool layout_cmdline(grid_overlay &overlay, const nvim::grid *grid,
+                           nvim::grid_point &cursor_position) {
+    const nvim::cmdline &cmdline = grid->cmdline();
+    const nvim::messages &messages = grid->messages();
+    const long grid_width = grid->width();
+    const long grid_height = grid->height();
+    overlay.clear();
+
+    if (grid_width <= 0 || grid_height <= 0) {
+        return false;
+    }
+
+    std::vector<overlay_line> lines;
+    const std::vector<nvim::message> &shown = messages.history().empty() ?
+                                              messages.shown() :
+                                              messages.history();
+
+    for (const nvim::message &message : shown) {
+        append_lines(lines, message.content);
+    }
+
+    std::string indent(cmdline.indent(), ' ');
+    overlay_line bottom;
+    size_t cursor_col = 0;
+
+    if (cmdline.visible()) {
+        for (size_t i=0; i<cmdline.block_size(); ++i) {
+            append_lines(lines, cmdline.block_line(i));
+        }
+
+        bottom.emplace_back(cmdline.firstc(), 0);
+        bottom.emplace_back(cmdline.prompt(), 0);
+        bottom.emplace_back(indent, 0);
+        cursor_col = display_width(cmdline.firstc()) +
+                    display_width(cmdline.prompt()) + indent.size();
+
+        // Split the content at the cursor, to insert the special character.
+        size_t offset = 0;
+        bool inserted = false;
+
+        for (const nvim::text_chunk &chunk : cmdline.content()) {
+            std::string_view text = chunk.text;
+
+            if (inserted || offset + text.size() < cmdline.pos()) {
+                bottom.emplace_back(text, chunk.hlid);
+                offset += text.size();
+                continue;
+            }
+
+            std::string_view before = text.substr(0, cmdline.pos() - offset);
+            std::string_view after = text.substr(before.size());
+            bottom.emplace_back(before, chunk.hlid);
+            cursor_col += display_width(before);
+            inserted = true;
+
+            if (!cmdline.special_char().empty()) {
+                bottom.emplace_back(cmdline.special_char(), chunk.hlid);
+
+                // Unshifted special characters replace the next character.
+                if (!cmdline.special_shift() && !after.empty()) {
+                    size_t end = 1;
+
+                    while (end < after.size() && (after[end] & 0xC0) == 0x80) {
+                        end += 1;
+                    }
+
+                    after.remove_prefix(end);
+                }
+            }
+
+            bottom.emplace_back(after, chunk.hlid);
+        }
+
+        if (!inserted) {
+            for (const nvim::text_chunk &chunk : cmdline.content()) {
+                cursor_col += display_width(chunk.text);
+            }
+
+            bottom.emplace_back(cmdline.special_char(), 0);
+        }
+
+        lines.push_back(std::move(bottom));
+    } else if (!messages.showmode().empty() || !messages.showcmd().empty() ||
+               !messages.ruler().empty()) {
+        for (const nvim::text_chunk &chunk : messages.showmode()) {
+            bottom.emplace_back(chunk.text, chunk.hlid);
+        }
+
+        lines.push_back(std::move(bottom));
+    }
+
+    if (lines.empty()) {
+        return false;
+    }
+
+    long rows = std::min<long>(lines.size(), grid_height);
+    overlay.reset(grid, grid_height - rows, 0, grid_width);
+
+    for (size_t i=lines.size() - rows; i<lines.size(); ++i) {
+        for (const auto &[text, hlid] : lines[i]) {
+            overlay.append(text, hlid);
+        }
+
+        // The mode indicator is left aligned, the command and ruler
+        // indicators are right aligned.
+        if (i == lines.size() - 1 && !cmdline.visible()) {
+            size_t right_width = 0;
+
+            for (const nvim::text_chunk &chunk : messages.showcmd()) {
+                right_width += display_width(chunk.text);
+            }
+
+            for (const nvim::text_chunk &chunk : messages.ruler()) {
+                right_width += display_width(chunk.text);
+            }
+
+            right_width += !messages.ruler().empty();
+            overlay.pad_row(grid_width - std::min<size_t>(right_width, grid_width), 0);
+
+            for (const nvim::text_chunk &chunk : messages.showcmd()) {
+                overlay.append(chunk.text, chunk.hlid);
+            }
+
+            if (!messages.ruler().empty()) {
+                overlay.append(" ", 0);
+            }
+
+            for (const nvim::text_chunk &chunk : messages.ruler()) {
+                overlay.append(chunk.text, chunk.hlid);
+            }
+        }
+
+        overlay.end_row(0);
+    }
+
+    if (!cmdline.visible()) {
+        return false;
+    }
+
+    cursor_position.row = grid_height - 1;
+    cursor_position.column = std::min<long>(cursor_col, grid_width - 1);
+    return true;
+}
+
+adjusted_grid::adjusted_grid(const nvim::grid *grid, const nvim::cursor &cursor,
+                             const grid_overlay &popupmenu,
+                             const grid_overlay &cmdline):
+    grid(grid), popupmenu(popupmenu), cmdline(cmdline) {
+    // If we're not dealing with a block cursor, no adjusments need to be
+    // made. We can iterate the grid row by row.
+    if (cursor.shape() != nvim::cursor_shape::block) {
+        adjusted_row = -1;
+        adjusted_col_begin = 0;
+        adjusted_col_end = 0;
+        return;
+    }
+
+    // We need to adjust the cursor cells.
+    // Grid's are immutable, so we make a copy of the adjusted cells.
+    size_t cursor_width = cursor.width();
+
+    adjusted_cells[0] = cursor.cell().recolored(cursor.foreground(),
+                                                cursor.background(),
+                                                cursor.special());
+
+    if (cursor_width == 2) {
+        nvim::cell right = grid->get(cursor.row(), cursor.col() + 1);
+        adjusted_cells[1] = right.recolored(cursor.foreground(),
+                                            cursor.background(),
+                                            cursor.special());
+    }
+
+    // When iterating over the cursor row, we swap out the cursor cells
+    // with our adjusted cells.
+    adjusted_row = cursor.row();
+    adjusted_col_begin = cursor.col();
+    adjusted_col_end = cursor.col() + cursor_width;
+}
+
+void frame_builder::set_grid(const nvim::grid *grid) {
+    grid_ = grid;
+    layout_popupmenu(popupmenu, grid);
+    cursor_on_cmdline = layout_cmdline(cmdline, grid, cmdline_cursor);
+}
+
+nvim::cursor frame_builder::cursor() const {
+    nvim::cursor cursor = grid_->cursor();
+
+    if (!cursor_on_cmdline) {
+        return cursor;
+    }
+
+    return cursor.moved(cmdline_cursor.row, cmdline_cursor.column,
+                        *cmdline.get(cmdline_cursor.row, cmdline_cursor.column));
+}
+
+void frame_builder::row_instances::clear() {
+    backgrounds.clear();
+    glyphs.clear();
+    lines.clear();
+    rows.clear();
+}
+
+void frame_builder::row_cache::clear() {
+    row_instances::clear();
+    index.clear();
+}
+
+void frame_builder::row_band::clear() {
+    row_instances::clear();
+    misses.clear();
+}
+
+static bool operator==(const line_metrics &left, const line_metrics &right) {
+    return left.ytranslate == right.ytranslate &&
+           left.period == right.period &&
+           left.thickness == right.thickness;
+}
+
+static bool operator==(const frame_metrics &left, const frame_metrics &right) {
+    return left.cell_size.x == right.cell_size.x &&
+           left.cell_size.y == right.cell_size.y &&
+           left.baseline.x == right.baseline.x &&
+           left.baseline.y == right.baseline.y &&
+           left.underline == right.underline &&
+           left.undercurl == right.undercurl &&
+           left.strikethrough == right.strikethrough &&
+           left.cursor_line_width == right.cursor_line_width;
+}
+
+void frame_builder::set_uniforms(const nvim::cursor &cursor,
+                                 simd_float2 drawable_size,
+                                 const frame_metrics &metrics) {
+    const simd_float2 pixel_size = simd_make_float2(2.0 / drawable_size.x,
+                                                    -2.0 / drawable_size.y);
+
+    uniforms.pixel_size         = pixel_size;
+    uniforms.cell_pixel_size    = metrics.cell_size;
+    uniforms.cell_size          = simd_make_float2(metrics.cell_size.x * pixel_size.x,
+                                                   metrics.cell_size.y * pixel_size.y);
+    uniforms.baseline           = metrics.baseline;
+    uniforms.cursor_position    = simd_make_short2(cursor.col(), cursor.row());
+    uniforms.cursor_color       = cursor.background();
+    uniforms.cursor_line_width  = metrics.cursor_line_width;
+    uniforms.cursor_cell_width  = cursor.width();
+}
+
+bool frame_builder::begin_frame(const frame_metrics &metrics,
+                                uint64_t glyph_generation) {
+    std::swap(current, previous);
+    current->clear();
+    current->width = grid_->width();
+
+    // Highlight changes may change the appearance of any row, without
+    // changing its hash.
+    bool reuse = previous_valid &&
+                 previous->width == current->width &&
+                 previous_highlights_tick == grid_->highlights_tick() &&
+                 previous_glyph_generation == glyph_generation &&
+                 previous_metrics == metrics;
+
+    previous_highlights_tick = grid_->highlights_tick();
+    previous_glyph_generation = glyph_generation;
+    previous_metrics = metrics;
+    return reuse;
+}
+
+void frame_builder::plan_rows(const adjusted_grid &adjusted, bool reuse) {
+    const int16_t height = grid_->height();
+    plans.resize(height);
+    pending.clear();
+
+    for (int16_t row = 0; row < height; ++row) {
+        row_plan &plan = plans[row];
+        plan.hash = grid_->row_hash(row);
+        plan.reusable = !adjusted.is_adjusted(row);
+        plan.source = -1;
+
+        if (reuse && plan.reusable) {
+            if (const uint32_t *source = previous->index.find(plan.hash)) {
+                plan.source = static_cast<int32_t>(*source);
+                continue;
+            }
+        }
+
+        pending.push_back(row);
+    }
+
+    const size_t cells = pending.size() * current->width;
+    bands_used = std::clamp<size_t>(cells / min_band_cells, 1, max_bands);
+    bands_used = std::min(bands_used, std::max<size_t>(pending.size(), 1));
+
+    // Pending rows are divided evenly, the first bands take the remainder.
+    const size_t rows_per_band = pending.size() / bands_used;
+    const size_t remainder = pending.size() % bands_used;
+    size_t begin = 0;
+
+    for (size_t i = 0; i < bands_used; ++i) {
+        row_band &band = bands[i];
+        band.clear();
+        band.pending_begin = begin;
+        begin += rows_per_band + (i < remainder);
+        band.pending_end = begin;
+    }
+}
+
+void frame_builder::append_backgrounds(std::vector<background_data> &backgrounds,
+                                       const uint32_t *colors, size_t width,
+                                       int16_t row) {
+    size_t begin = 0;
+
+    while (begin < width) {
+        const uint32_t color = colors[begin];
+        size_t end = begin + 1;
+
+        // Most rows are long runs of one color, so runs are extended eight
+        // cells at a time. The inner loop has no branches, which lets the
+        // compiler vectorize it.
+        while (end + 8 <= width) {
+            uint32_t differs = 0;
+
+            for (size_t i = 0; i < 8; ++i) {
+                differs |= colors[end + i] ^ color;
+            }
+
+            if (differs) {
+                break;
+            }
+
+            end += 8;
+        }
+
+        while (end < width && colors[end] == color) {
+            end += 1;
+        }
+
+        simd_short2 gridpos = simd_make_short2(static_cast<int16_t>(begin), row);
+        backgrounds.emplace_back(gridpos, color, static_cast<uint32_t>(end - begin));
+        begin = end;
+    }
+}
+
+void frame_builder::append_row(const row_instances &from, uint32_t index,
+                               int16_t from_row, int16_t row) {
+    row_cache &to = *current;
+    const row_span &from_span = from.rows[index];
+
+    row_span span;
+    span.backgrounds_begin = static_cast<uint32_t>(to.backgrounds.size());
+    span.glyphs_begin = static_cast<uint32_t>(to.glyphs.size());
+    span.lines_begin = static_cast<uint32_t>(to.lines.size());
+
+    to.backgrounds.insert(to.backgrounds.end(),
+                          from.backgrounds.begin() + from_span.backgrounds_begin,
+                          from.backgrounds.begin() + from_span.backgrounds_end);
+
+    to.glyphs.insert(to.glyphs.end(),
+                     from.glyphs.begin() + from_span.glyphs_begin,
+                     from.glyphs.begin() + from_span.glyphs_end);
+
+    to.lines.insert(to.lines.end(),
+                    from.lines.begin() + from_span.lines_begin,
+                    from.lines.begin() + from_span.lines_end);
+
+    span.backgrounds_end = static_cast<uint32_t>(to.backgrounds.size());
+    span.glyphs_end = static_cast<uint32_t>(to.glyphs.size());
+    span.lines_end = static_cast<uint32_t>(to.lines.size());
+    to.rows.push_back(span);
+
+    // Moved rows, e.g. after a scroll, keep their columns but not their row.
+    if (from_row != row) {
+        for (uint32_t i = span.backgrounds_begin; i < span.backgrounds_end; ++i) {
+            to.backgrounds[i].grid_position.y = row;
+        }
+
+        for (uint32_t i = span.glyphs_begin; i < span.glyphs_end; ++i) {
+            to.glyphs[i].grid_position.y = row;
+        }
+
+        for (uint32_t i = span.lines_begin; i < span.lines_end; ++i) {
+            to.lines[i].grid_position.y = row;
+        }
+    }
+}
+
+frame_counts frame_builder::end_frame() {
+    row_cache &cache = *current;
+    const int16_t height = grid_->height();
+    size_t band_index = 0;
+    uint32_t band_row = 0;
+
+    for (int16_t row = 0; row < height; ++row) {
+        const row_plan &plan = plans[row];
+
+        if (plan.source >= 0) {
+            append_row(*previous, plan.source, plan.source, row);
+        } else {
+            while (band_row == bands[band_index].rows.size()) {
+                band_index += 1;
+                band_row = 0;
+            }
+
+            append_row(bands[band_index], band_row, row, row);
+            band_row += 1;
+        }
+
+        if (plan.reusable && !cache.index.find(plan.hash)) {
+            cache.index.insert_unique(plan.hash, static_cast<uint32_t>(row));
+        }
+    }
+
+    previous_valid = true;
+
+    frame_counts counts;
+    counts.backgrounds = cache.backgrounds.size();
+    counts.glyphs = cache.glyphs.size();
+    counts.lines = cache.lines.size();
+    return counts;
+}
+
+void frame_builder::write(const frame_buffers &buffers) const {
+    const row_cache &cache = *current;
+
+    // The frame buffers may be write combined, so they're written once, in
+    // order, and never read.
+    *buffers.uniforms = uniforms;
+    std::copy(cache.backgrounds.begin(), cache.backgrounds.end(), buffers.backgrounds);
+    std::copy(cache.glyphs.begin(), cache.glyphs.end(), buffers.glyphs);
+    std::copy(cache.lines.begin(), cache.lines.end(), buffers.lines);
+}
@@ -0,0 +1,495 @@
+//
+//  Neovim Mac
+//  frame_builder.hpp
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#ifndef FRAME_BUILDER_HPP
+#define FRAME_BUILDER_HPP
+
+#include <dispatch/dispatch.h>
+#include <vector>
+#include "flat_map.hpp"
+#include "shader_types.hpp"
+#include "ui.hpp"
+
+/// A rectangle of cells drawn over a grid.
+/// With ext_popupmenu, ext_cmdline, and ext_messages, Neovim doesn't draw the
+/// popup menu, command line, or messages into the grid. We lay them out in
+/// overlays instead, as Neovim would.
+class grid_overlay {
+private:
+    std::vector<nvim::cell> cells;
+    const nvim::grid *grid;
+    int16_t top;
+    int16_t left;
+    int16_t width;
+    int16_t height;
+    int16_t row_begin;
+
+public:
+    grid_overlay(): grid(nullptr), top(0), left(0), width(0), height(0),
+                    row_begin(0) {}
+
+    /// Clears the overlay.
+    void clear() {
+        cells.clear();
+        width = 0;
+        height = 0;
+    }
+
+    /// Clears the overlay, and positions it for rows of the given width.
+    void reset(const nvim::grid *overlay_grid, long row, long col, long columns);
+
+    /// The number of cells in the current row.
+    size_t row_size() const {
+        return cells.size() - row_begin;
+    }
+
+    /// Appends text to the current row, one cell per grapheme, two for double
+    /// width graphemes. The text is padded with spaces, or truncated, to
+    /// field_width cells.
+    void append(std::string_view text, size_t field_width, uint16_t hlid);
+
+    /// Appends as much of text as fits in the current row.
+    void append(std::string_view text, uint16_t hlid);
+
+    /// Pads the current row with spaces, or truncates it, to columns cells.
+    void pad_row(size_t columns, uint16_t hlid);
+
+    /// Pads, or truncates, the current row to the overlay's width, and starts
+    /// a new row.
+    void end_row(uint16_t hlid);
+
+    /// True if the overlay covers any cells in the given grid row.
+    bool covers(int16_t row) const {
+        return width > 0 && row >= top && row < top + height;
+    }
+
+    /// Returns the overlay cell at the given grid position, or null if the
+    /// position is outside the overlay.
+    const nvim::cell* get(int16_t row, int16_t col) const {
+        int16_t overlay_row = row - top;
+        int16_t overlay_col = col - left;
+
+        if (overlay_row < 0 || overlay_row >= height ||
+            overlay_col < 0 || overlay_col >= width) {
+            return nullptr;
+        }
+
+        return &cells[(overlay_row * width) + overlay_col];
+    }
+};
+
+/// Adjusts the color attributes of cells under a block cursor, and draws
+/// overlays over the grid.
+class adjusted_grid {
+private:
+    const nvim::grid *grid;
+    const grid_overlay &popupmenu;
+    const grid_overlay &cmdline;
+    nvim::cell adjusted_cells[2];
+    int16_t adjusted_row;
+    int16_t adjusted_col_begin;
+    int16_t adjusted_col_end;
+
+    /// Calls callback with the grid cell at row and col, or with the overlay
+    /// cell if an overlay covers the position.
+    template<typename Callable>
+    void visit(int16_t row, int16_t col, Callable &callback) const {
+        if (const nvim::cell *menu_cell = popupmenu.get(row, col)) {
+            callback(row, col, menu_cell);
+        } else if (const nvim::cell *cmdline_cell = cmdline.get(row, col)) {
+            callback(row, col, cmdline_cell);
+        } else {
+            nvim::cell cell = grid->get(row, col);
+            callback(row, col, &cell);
+        }
+    }
+
+public:
+    adjusted_grid(const nvim::grid *grid, const nvim::cursor &cursor,
+                  const grid_overlay &popupmenu, const grid_overlay &cmdline);
+
+    /// True if the cells of the given row may differ from the grid's cells,
+    /// because they're under a block cursor or an overlay.
+    bool is_adjusted(int16_t row) const {
+        return row == adjusted_row || popupmenu.covers(row) ||
+               cmdline.covers(row);
+    }
+
+    /// Iterate over a row of the cursor adjusted grid.
+    /// Calls the function object callback once for every cell in the row in
+    /// ascending order. The callback is invoked with three arguments:
+    ///   1. The cell's row (int16_t).
+    ///   2. The cell's column (int16_t).
+    ///   3. A const pointer to the cell (const nvim::cell*).
+    /// The return value of the callback is ignored.
+    template<typename Callable>
+    void for_each_in_row(int16_t row, Callable callback) const {
+        const int16_t width = grid->width();
+
+        // Grids store packed cells, so each cell is resolved before it's
+        // passed to the callback, unless it's covered by an overlay.
+        if (row != adjusted_row) {
+            for (int16_t col = 0; col < width; ++col) {
+                visit(row, col, callback);
+            }
+
+            return;
+        }
+
+        for (int16_t col = 0; col < adjusted_col_begin; ++col) {
+            visit(row, col, callback);
+        }
+
+        for (int16_t col = adjusted_col_begin; col < adjusted_col_end; ++col) {
+            callback(row, col, adjusted_cells + (col - adjusted_col_begin));
+        }
+
+        for (int16_t col = adjusted_col_end; col < width; ++col) {
+            visit(row, col, callback);
+        }
+    }
+
+    /// Iterate over the cursor adjusted grid.
+    /// Calls the function object callback once for every cell in ascending
+    /// order, with the same arguments as for_each_in_row().
+    template<typename Callable>
+    void for_each(Callable callback) const {
+        const int16_t height = grid->height();
+
+        for (int16_t row = 0; row < height; ++row) {
+            for_each_in_row(row, callback);
+        }
+    }
+};
+
+/// Font dependent metrics used to position a frame's instances.
+struct frame_metrics {
+    simd_float2 cell_size;          ///< The size of a cell in pixels.
+    simd_float2 baseline;           ///< Translation from a cell to its baseline.
+    line_metrics underline;
+    line_metrics undercurl;
+    line_metrics strikethrough;
+    uint32_t cursor_line_width;     ///< The thickness of cursor lines in pixels.
+};
+
+/// Plain memory a frame is written to. Each buffer must have room for the
+/// number of instances frame_builder::build() returned.
+struct frame_buffers {
+    uniform_data *uniforms;
+    background_data *backgrounds;
+    glyph_data *glyphs;
+    line_data *lines;
+};
+
+/// The number of instances written to each of a frame's buffers.
+struct frame_counts {
+    size_t backgrounds;
+    size_t glyphs;
+    size_t lines;
+};
+
+/// Builds the per frame instance data drawn by our shaders.
+///
+/// A frame is a grid, its overlays, and a cursor, turned into a
+/// background_data for every run of same colored cells in a row, a glyph_data
+/// for every non empty cell, line_data for underlines, undercurls, and
+/// strikethroughs, and the cursor's uniforms. Frames are built, then written
+/// to plain memory, and glyphs are looked up with caller supplied functions,
+/// so frames can be built without Metal. This lets us measure and test frame
+/// building on machines without a GPU, see test/FrameBuilder.mm.
+///
+/// Each row's instances are kept until the next frame, indexed by the row's
+/// content hash. Rows whose contents haven't changed, including rows that
+/// have only moved, are copied from the previous frame rather than rebuilt.
+/// Rows under a block cursor or an overlay are always rebuilt. The rows that
+/// are rebuilt are split into bands, which are built on multiple cores.
+class frame_builder {
+private:
+    struct identity_hash {
+        size_t operator()(uint64_t hash) const {
+            return hash;
+        }
+    };
+
+    struct equal_hash {
+        bool operator()(uint64_t left, uint64_t right) const {
+            return left == right;
+        }
+    };
+
+    // The instances of a row, as offsets into a row_instances.
+    struct row_span {
+        uint32_t backgrounds_begin;
+        uint32_t backgrounds_end;
+        uint32_t glyphs_begin;
+        uint32_t glyphs_end;
+        uint32_t lines_begin;
+        uint32_t lines_end;
+    };
+
+    // Instances of consecutive rows.
+    struct row_instances {
+        std::vector<background_data> backgrounds;
+        std::vector<glyph_data> glyphs;
+        std::vector<line_data> lines;
+        std::vector<row_span> rows;
+
+        void clear();
+    };
+
+    // A frame's instances, and the rows they were built from.
+    struct row_cache : row_instances {
+        // Maps the hashes of rows that may be reused to their row index.
+        flat_map<uint64_t, uint32_t, identity_hash, equal_hash> index;
+        size_t width;
+
+        void clear();
+    };
+
+    // A glyph that wasn't in the glyph cache when its row was built.
+    struct glyph_miss {
+        uint32_t glyph;
+        nvim::cell cell;
+    };
+
+    // Rows that are built together, on one thread. Bands are built in
+    // parallel, so glyph cache misses are recorded, and resolved later on the
+    // building thread.
+    struct row_band : row_instances {
+        std::vector<glyph_miss> misses;
+        std::vector<uint32_t> colors;
+        size_t pending_begin;
+        size_t pending_end;
+
+        void clear();
+    };
+
+    // How a row is built. Rows with a source are copied from that row of the
+    // previous frame, other rows are built by a band.
+    struct row_plan {
+        uint64_t hash;
+        int32_t source;
+        bool reusable;
+    };
+
+    // Splitting a frame into bands only pays off for large frames. A band has
+    // at least min_band_cells cells.
+    static constexpr size_t min_band_cells = 4096;
+    static constexpr size_t max_bands = 16;
+
+    const nvim::grid *grid_;
+    grid_overlay popupmenu;
+    grid_overlay cmdline;
+    nvim::grid_point cmdline_cursor;
+    bool cursor_on_cmdline;
+
+    // Rows are built into current, and reused from previous.
+    row_cache caches[2];
+    row_cache *current;
+    row_cache *previous;
+
+    uniform_data uniforms;
+    std::vector<row_plan> plans;
+    std::vector<int16_t> pending;
+    row_band bands[max_bands];
+    size_t bands_used;
+
+    // The state the previous frame was built with. If any of it changes, the
+    // previous frame's rows can't be reused.
+    bool previous_valid;
+    uint64_t previous_highlights_tick;
+    uint64_t previous_glyph_generation;
+    frame_metrics previous_metrics;
+
+    void set_uniforms(const nvim::cursor &cursor, simd_float2 drawable_size,
+                      const frame_metrics &metrics);
+
+    bool begin_frame(const frame_metrics &metrics, uint64_t glyph_generation);
+
+    /// Plans each row of the frame, and divides the rows that must be built
+    /// among bands_used bands.
+    void plan_rows(const adjusted_grid &adjusted, bool reuse);
+
+    /// Appends background_data objects for each run of equal colors in a row
+    /// of colors to backgrounds.
+    static void append_backgrounds(std::vector<background_data> &backgrounds,
+                                   const uint32_t *colors, size_t width,
+                                   int16_t row);
+
+    /// Appends a row of from to the current frame. The row's instances were
+    /// built for from_row, and are moved to row if they differ.
+    void append_row(const row_instances &from, uint32_t index,
+                    int16_t from_row, int16_t row);
+
+    /// Assembles the planned rows into the current frame in order.
+    frame_counts end_frame();
+
+    /// Calls callable(size_t index) for each band in use, concurrently.
+    template<typename Callable>
+    void for_each_band(Callable &callable) {
+        if (bands_used == 1) {
+            callable(0);
+            return;
+        }
+
+        dispatch_apply_f(bands_used, DISPATCH_APPLY_AUTO, &callable,
+                         [](void *context, size_t index) {
+            (*static_cast<Callable*>(context))(index);
+        });
+    }
+
+    /// Builds a row's instances into band. Called concurrently, so the only
+    /// shared state touched is read only.
+    template<typename GlyphFind>
+    static void build_row(row_band &band, const adjusted_grid &adjusted,
+                          int16_t row, const frame_metrics &metrics,
+                          GlyphFind &find) {
+        row_span span;
+        span.glyphs_begin = static_cast<uint32_t>(band.glyphs.size());
+        span.lines_begin = static_cast<uint32_t>(band.lines.size());
+        band.colors.clear();
+
+        int16_t undercurl_next = -1;
+        uint16_t undercurl_position = 0;
+
+        adjusted.for_each_in_row(row, [&](int16_t, int16_t col,
+                                          const nvim::cell *cell) {
+            simd_short2 gridpos = simd_make_short2(col, row);
+            band.colors.push_back(cell->background());
+
+            if (cell->has_line_emphasis()) {
+                nvim::rgb_color color = cell->special();
+
+                // Undercurls and underlines are mutually exclusive. We'll
+                // make undercurls take priority, they usually represent
+                // errors, so users won't appreciate them being hidden.
+                if (cell->has_undercurl()) {
+                    if (undercurl_next == col) {
+                        undercurl_position += 1;
+                    } else {
+                        undercurl_position = 0;
+                    }
+
+                    undercurl_next = col + 1;
+                    band.lines.emplace_back(gridpos, color, metrics.undercurl,
+                                            undercurl_position);
+                } else if (cell->has_underline()) {
+                    band.lines.emplace_back(gridpos, color, metrics.underline);
+                }
+
+                if (cell->has_strikethrough()) {
+                    band.lines.emplace_back(gridpos, color, metrics.strikethrough);
+                }
+            }
+
+            if (!cell->empty()) {
+                if (const glyph_rect *glyph = find(*cell)) {
+                    band.glyphs.emplace_back(gridpos, cell->width(), *glyph);
+                } else {
+                    uint32_t index = static_cast<uint32_t>(band.glyphs.size());
+                    band.glyphs.emplace_back(gridpos, cell->width(), glyph_rect{});
+                    band.misses.push_back(glyph_miss{index, *cell});
+                }
+            }
+        });
+
+        span.backgrounds_begin = static_cast<uint32_t>(band.backgrounds.size());
+        append_backgrounds(band.backgrounds, band.colors.data(),
+                           band.colors.size(), row);
+
+        span.backgrounds_end = static_cast<uint32_t>(band.backgrounds.size());
+        span.glyphs_end = static_cast<uint32_t>(band.glyphs.size());
+        span.lines_end = static_cast<uint32_t>(band.lines.size());
+        band.rows.push_back(span);
+    }
+
+public:
+    frame_builder(): grid_(nullptr), cmdline_cursor{}, cursor_on_cmdline(false),
+                     current(&caches[0]), previous(&caches[1]), uniforms{},
+                     bands_used(0), previous_valid(false), previous_highlights_tick(0),
+                     previous_glyph_generation(0), previous_metrics{} {}
+
+    frame_builder(const frame_builder&) = delete;
+    frame_builder& operator=(const frame_builder&) = delete;
+
+    /// Sets the grid frames are built from, and lays out its overlays.
+    void set_grid(const nvim::grid *grid);
+
+    /// Returns the current grid.
+    const nvim::grid* grid() const {
+        return grid_;
+    }
+
+    /// Returns the grid's cursor. With ext_cmdline, the cursor is moved onto
+    /// the command line while it's visible.
+    nvim::cursor cursor() const;
+
+    /// Discards the rows kept from the previous frame. Call this when glyph
+    /// lookups would return different results, e.g. after a font change.
+    void invalidate() {
+        previous_valid = false;
+    }
+
+    /// Builds a frame, which is kept until the next frame is built. Call
+    /// write() to copy it to buffers sized using the returned counts.
+    ///
+    /// Rows that can't be reused from the previous frame are split into bands
+    /// and built in parallel. Glyphs are first looked up with find, which is
+    /// called concurrently. Glyphs find doesn't return are then looked up with
+    /// lookup, which is only called on the calling thread.
+    ///
+    /// @param cursor           The cursor to draw.
+    /// @param drawable_size    The size of the drawable in pixels.
+    /// @param metrics          The current font's metrics.
+    /// @param glyph_generation A count that changes whenever glyph_rects
+    ///                         previously returned by lookup are invalidated.
+    /// @param find             A thread safe function object invoked as
+    ///                         find(const nvim::cell&), returning a pointer to
+    ///                         the cell's cached glyph_rect, or null if the
+    ///                         glyph isn't cached.
+    /// @param lookup           A function object invoked as
+    ///                         lookup(const nvim::cell&) for every glyph not
+    ///                         found by find, returning the cell's glyph_rect.
+    /// @returns The number of instances of each type in the frame.
+    template<typename GlyphFind, typename GlyphLookup>
+    frame_counts build(const nvim::cursor &cursor, simd_float2 drawable_size,
+                       const frame_metrics &metrics, uint64_t glyph_generation,
+                       GlyphFind &&find, GlyphLookup &&lookup) {
+        set_uniforms(cursor, drawable_size, metrics);
+        bool reuse = begin_frame(metrics, glyph_generation);
+
+        adjusted_grid adjusted(grid_, cursor, popupmenu, cmdline);
+        plan_rows(adjusted, reuse);
+
+        auto build_band = [&](size_t index) {
+            row_band &band = bands[index];
+
+            for (size_t i = band.pending_begin; i < band.pending_end; ++i) {
+                build_row(band, adjusted, pending[i], metrics, find);
+            }
+        };
+
+        for_each_band(build_band);
+
+        for (size_t i = 0; i < bands_used; ++i) {
+            row_band &band = bands[i];
+
+            for (const glyph_miss &miss : band.misses) {
+                band.glyphs[miss.glyph].rect = lookup(miss.cell);
+            }
+        }
+
+        return end_frame();
+    }
+
+    /// Writes the last frame built to buffers.
+    void write(const frame_buffers &buffers) const;
+};
+
+#endif // FRAME_BUILDER_HPP
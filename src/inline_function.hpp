@@ -0,0 +1,180 @@
+//
+//  Neovim Mac
+//  inline_function.hpp
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#ifndef INLINE_FUNCTION_HPP
+#define INLINE_FUNCTION_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<typename Signature, size_t Capacity = 48>
+class inline_function;
+
+/// A move only, type erased, function object wrapper.
+///
+/// Similar to std::function, except callables are stored inline when they fit
+/// in Capacity bytes, which avoids a heap allocation for most lambdas. Larger
+/// callables, or callables that may throw on move, fall back to the heap.
+///
+/// Unlike std::function, inline_function is not copyable. This allows it to
+/// hold move only callables, and means we never have to copy captured state.
+///
+/// Invoking an empty inline_function is undefined.
+template<typename R, typename ...Args, size_t Capacity>
+class inline_function<R(Args...), Capacity> {
+private:
+    static_assert(Capacity >= sizeof(void*), "Capacity must hold a pointer");
+
+    enum class operation {
+        move,
+        destroy
+    };
+
+    using invoke_type = R(*)(void *storage, Args ...args);
+    using manage_type = void(*)(operation op, void *storage, void *dest);
+
+    alignas(std::max_align_t) unsigned char storage[Capacity];
+    invoke_type invoker;
+    manage_type manager;
+
+    template<typename F>
+    static constexpr bool is_stored_inline =
+        sizeof(F) <= Capacity &&
+        alignof(F) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible_v<F>;
+
+    // Callables stored inline live directly in storage. Move operations move
+    // construct into the destination storage.
+    template<typename F>
+    struct inline_ops {
+        static R invoke(void *storage, Args ...args) {
+            return (*static_cast<F*>(storage))(std::forward<Args>(args)...);
+        }
+
+        static void manage(operation op, void *storage, void *dest) {
+            F *callable = static_cast<F*>(storage);
+
+            if (op == operation::move) {
+                new (dest) F(std::move(*callable));
+            }
+
+            callable->~F();
+        }
+    };
+
+    // Callables stored on the heap are referenced by a pointer in storage.
+    // Move operations just transfer the pointer.
+    template<typename F>
+    struct heap_ops {
+        static F*& pointer(void *storage) {
+            return *static_cast<F**>(storage);
+        }
+
+        static R invoke(void *storage, Args ...args) {
+            return (*pointer(storage))(std::forward<Args>(args)...);
+        }
+
+        static void manage(operation op, void *storage, void *dest) {
+            if (op == operation::move) {
+                new (dest) F*(pointer(storage));
+            } else {
+                delete pointer(storage);
+            }
+        }
+    };
+
+    void reset() {
+        if (manager) {
+            manager(operation::destroy, storage, nullptr);
+            invoker = nullptr;
+            manager = nullptr;
+        }
+    }
+
+    void move_from(inline_function &other) {
+        invoker = other.invoker;
+        manager = other.manager;
+
+        if (manager) {
+            manager(operation::move, other.storage, storage);
+            other.invoker = nullptr;
+            other.manager = nullptr;
+        }
+    }
+
+public:
+    /// Constructs an empty inline_function.
+    inline_function(): invoker(nullptr), manager(nullptr) {}
+
+    /// Constructs an empty inline_function.
+    inline_function(std::nullptr_t): inline_function() {}
+
+    /// Constructs an inline_function holding callable.
+    template<typename Callable,
+             typename F = std::decay_t<Callable>,
+             typename = std::enable_if_t<!std::is_same_v<F, inline_function> &&
+                                         std::is_invocable_r_v<R, F&, Args...>>>
+    inline_function(Callable &&callable) {
+        if constexpr (is_stored_inline<F>) {
+            new (storage) F(std::forward<Callable>(callable));
+            invoker = inline_ops<F>::invoke;
+            manager = inline_ops<F>::manage;
+        } else {
+            new (storage) F*(new F(std::forward<Callable>(callable)));
+            invoker = heap_ops<F>::invoke;
+            manager = heap_ops<F>::manage;
+        }
+    }
+
+    inline_function(const inline_function&) = delete;
+    inline_function& operator=(const inline_function&) = delete;
+
+    inline_function(inline_function &&other) {
+        move_from(other);
+    }
+
+    inline_function& operator=(inline_function &&other) {
+        if (this != &other) {
+            reset();
+            move_from(other);
+        }
+
+        return *this;
+    }
+
+    /// Destroys the held callable, leaving the inline_function empty.
+    inline_function& operator=(std::nullptr_t) {
+        reset();
+        return *this;
+    }
+
+    ~inline_function() {
+        reset();
+    }
+
+    /// True if a callable is held, otherwise false.
+    explicit operator bool() const {
+        return invoker;
+    }
+
+    /// Invokes the held callable.
+    R operator()(Args ...args) {
+        return invoker(storage, std::forward<Args>(args)...);
+    }
+
+    /// True if callables of type F are stored without a heap allocation.
+    template<typename F>
+    static constexpr bool stores_inline() {
+        return is_stored_inline<std::decay_t<F>>;
+    }
+};
+
+#endif // INLINE_FUNCTION_HPP
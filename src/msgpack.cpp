@@ -145,6 +145,100 @@ struct type_string_visitor : base_visitor {
     }
 };
 
+struct packed_size_visitor {
+    size_t size = 0;
+
+    // Header size of strings, binaries, and extensions with 8, 16, or 32 bit
+    // lengths.
+    static size_t length_header(size_t length) {
+        if (length <= std::numeric_limits<uint8_t>::max()) return 2;
+        if (length <= std::numeric_limits<uint16_t>::max()) return 3;
+        return 5;
+    }
+
+    // Header size of arrays and maps, which have no 8 bit length encoding.
+    static size_t container_header(size_t length) {
+        if (length <= 15) return 1;
+        if (length <= std::numeric_limits<uint16_t>::max()) return 3;
+        return 5;
+    }
+
+    void operator()(const msg::invalid&) {}
+
+    void operator()(const msg::null&) {
+        size += 1;
+    }
+
+    void operator()(const msg::boolean&) {
+        size += 1;
+    }
+
+    void operator()(const msg::float64&) {
+        size += 9;
+    }
+
+    void operator()(const msg::integer &val) {
+        int64_t value = val.signed_value();
+
+        if (value >= -32 && value <= 127) {
+            size += 1;
+        } else if (value >= std::numeric_limits<int8_t>::min() &&
+                   value <= std::numeric_limits<uint8_t>::max()) {
+            size += 2;
+        } else if (value >= std::numeric_limits<int16_t>::min() &&
+                   value <= std::numeric_limits<uint16_t>::max()) {
+            size += 3;
+        } else if (value >= std::numeric_limits<int32_t>::min() &&
+                   value <= std::numeric_limits<uint32_t>::max()) {
+            size += 5;
+        } else {
+            size += 9;
+        }
+    }
+
+    void operator()(const msg::string &val) {
+        size += (val.size() <= 31 ? 1 : length_header(val.size())) + val.size();
+    }
+
+    void operator()(const msg::binary &val) {
+        size += length_header(val.size()) + val.size();
+    }
+
+    // Extension objects include their type byte.
+    void operator()(const msg::extension &val) {
+        switch (val.size()) {
+            case 2:
+            case 3:
+            case 5:
+            case 9:
+            case 17:
+                size += 1 + val.size();
+                break;
+
+            default:
+                size += length_header(val.size() - 1) + val.size();
+                break;
+        }
+    }
+
+    void operator()(const msg::array &array) {
+        size += container_header(array.size());
+
+        for (const msg::object &obj : array) {
+            std::visit(*this, obj);
+        }
+    }
+
+    void operator()(const msg::map &map) {
+        size += container_header(map.size());
+
+        for (const msg::pair &pair : map) {
+            std::visit(*this, pair.first);
+            std::visit(*this, pair.second);
+        }
+    }
+};
+
 // Returns a reference to the promise_type of the current coroutine.
 template<typename Promise>
 auto get_current_promise() {
@@ -229,6 +323,12 @@ std::string type_string(const object &obj) {
     return visitor.buffer;
 }
 
+size_t packed_size(const object &obj) {
+    packed_size_visitor visitor;
+    std::visit(visitor, obj);
+    return visitor.size;
+}
+
 // Returns an Awaitable that reads size bytes into dest from the input buffer
 auto unpacker::promise_type::read_bytes(void *dest, size_t size) {
     struct byte_reader {
@@ -276,6 +276,10 @@ std::string to_string(const msg::object &obj);
 /// @returns A string representation of the objects type.
 std::string type_string(const msg::object &obj);
 
+/// @returns The number of bytes obj takes up when MessagePack encoded using
+///          the smallest encoding for each value, as Neovim encodes it.
+size_t packed_size(const msg::object &obj);
+
 /// Deserializes a stream of MessagePack encoded bytes into C++ objects.
 ///
 /// The unpacker interface is split into two parts, feeding and unpacking.
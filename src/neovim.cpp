@@ -9,6 +9,9 @@
 
 #include <unistd.h>
 #include <spawn.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <limits>
@@ -40,8 +43,15 @@ namespace nvim {
 // There's a special id, null_msgid, which indicates that a request / response
 // has no response handler associated with it.
 //
-// Response handlers are stored in response contexts. Response contexts do
-// additional bookkeeping to track timed out requests.
+// Response handlers are stored in response contexts, along with the
+// cancellation token they were registered with.
+//
+// Msgids encode a handler table slot and the slot's generation. When a request
+// completes, times out, or is cancelled, its slot is vacated immediately and
+// the slot's generation is incremented. Any response that arrives for a
+// vacated slot carries a stale generation, so it's dropped with a single
+// comparison. This keeps the handler table small, even when many requests
+// time out or are cancelled.
 static constexpr uint32_t null_msgid = std::numeric_limits<uint32_t>::max();
 
 /// Allocate a new response context. Should be freed with free_context().
@@ -57,89 +67,160 @@ process::response_context* process::response_handler_table::alloc_context() {
 }
 
 /// Map a response context to a msgid.
-/// The context can be accessed using get_context(msgid).
+/// The context can be removed using take_context(msgid).
 uint32_t process::response_handler_table::store_context(response_context *ctx) {
-    const size_t table_size = handler_table.size();
+    const size_t table_size = slots.size();
 
     size_t empty_slot = [&](){
         for (size_t i=last_index + 1; i<table_size; ++i) {
-            if (!handler_table[i]) return i;
+            if (!slots[i].context) return i;
         }
 
         for (size_t i=0; i<last_index; ++i) {
-            if (!handler_table[i]) return i;
+            if (!slots[i].context) return i;
         }
 
         return table_size;
     }();
 
     if (empty_slot == table_size) {
-        handler_table.resize(table_size * 2);
+        if (table_size * 2 > slot_mask) {
+            std::abort();
+        }
+
+        slots.resize(table_size * 2);
     }
 
     last_index = empty_slot;
-    handler_table[empty_slot] = ctx;
+    slots[empty_slot].context = ctx;
 
-    return (uint32_t)empty_slot;
+    uint32_t generation = slots[empty_slot].generation;
+    ctx->msgid = (uint32_t)empty_slot | (generation << slot_bits);
+    return ctx->msgid;
+}
+
+/// Removes the context mapped to msgid from the table.
+/// @returns The context, or nullptr if msgid does not map to a context.
+process::response_context*
+process::response_handler_table::take_context(uint32_t msgid) {
+    uint32_t index = msgid & slot_mask;
+    uint32_t generation = msgid >> slot_bits;
+
+    if (index >= slots.size()) {
+        return nullptr;
+    }
+
+    slot &entry = slots[index];
+
+    if (!entry.context || entry.generation != generation) {
+        return nullptr;
+    }
+
+    response_context *context = entry.context;
+    entry.context = nullptr;
+    entry.generation = (generation + 1) & generation_mask;
+    return context;
 }
 
 /// Registers a response handler.
+/// If the token has a deadline, the handler is registered with a timeout.
 /// @returns The response handlers msgid.
-uint32_t process::store_handler(response_handler &&handler) {
+uint32_t process::store_handler(response_handler &&handler,
+                                const cancellation_token &token) {
+    if (token.deadline() != DISPATCH_TIME_FOREVER) {
+        return store_handler(DISPATCH_TIME_FOREVER, std::move(handler), token);
+    }
+
     std::lock_guard lock(*handler_table);
 
     response_context *context = handler_table->alloc_context();
-    context->table = handler_table;
     context->handler = std::move(handler);
-    context->complete = false;
-    context->timed_out = false;
-    context->has_timeout = false;
+    context->token = token;
 
     return handler_table->store_context(context);
 }
 
+/// The key of the IO queue's handler table, see dispatch_queue_set_specific.
+static char handler_table_key;
+
 /// Registers a response handler with a timeout.
+/// The timeout is shortened to the token's deadline if it's earlier.
 /// @returns The response handlers msgid.
 uint32_t process::store_handler(dispatch_time_t timeout,
-                                response_handler &&handler) {
+                                response_handler &&handler,
+                                const cancellation_token &token) {
     std::lock_guard lock(*handler_table);
 
-    // Timeouts are implemented using dispatch_after. We register the handler
-    // and fire off an accompanying dispatch_after block, which will either:
-    //   1. Handle a timeout.
-    //   2. Release the response context.
-    //
-    // The context is freed when it's timeout has expired and the server has
-    // responded. This means that a context will live, at minimum, until its
-    // timeout has fired. In the worst case, where we never receive a response
-    // from the server, a context will live for the lifetime of the process
-    // object.
     response_context *context = handler_table->alloc_context();
-    context->table = handler_table;
     context->handler = std::move(handler);
-    context->complete = false;
-    context->timed_out = false;
-    context->has_timeout = true;
+    context->token = token;
+    uint32_t msgid = handler_table->store_context(context);
+
+    // Timeouts are implemented using dispatch_after. The dispatch_after block
+    // only holds the request's msgid, so contexts are freed as soon as their
+    // request completes or is cancelled. If the msgid still maps to a context
+    // when the block runs, the request has timed out. Blocks run on the IO
+    // queue, which holds the handler table, and outlives the process object.
+    void *block_context = reinterpret_cast<void*>(static_cast<uintptr_t>(msgid));
+
+    dispatch_after_f(token.deadline(timeout), queue, block_context, [](void *ptr) {
+        uint32_t msgid = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(ptr));
+        auto *table = static_cast<response_handler_table*>(
+            dispatch_get_specific(&handler_table_key));
+
+        std::unique_lock lock(*table);
+        response_context *context = table->take_context(msgid);
+
+        // The request completed, or was cancelled.
+        if (!context) {
+            return;
+        }
 
-    dispatch_after_f(timeout, queue, context, [](void *ptr) {
-        response_context *context = static_cast<response_context*>(ptr);
-        std::lock_guard lock(*context->table);
+        // We've timed out. Call the handler outside of the lock, allowing it
+        // to make further requests.
+        response_handler handler = std::move(context->handler);
+        cancellation_token token = std::move(context->token);
+        table->free_context(context);
+        lock.unlock();
 
-        if (context->complete) {
-            // The request has completed. We're done, free and return.
-            context->table->free_context(context);
-        } else {
-            // We've timed out. Mark the context as having timed out and call
-            // the response handler. We overwrite the handler so we can free any
-            // resources it may be holding. We can't free this context yet, we
-            // might still receive a server response somewhere down the line.
-            context->timed_out = true;
-            context->handler(msg::object(), msg::object(), true);
-            context->handler = response_handler();
+        if (!token.cancelled()) {
+            handler(msg::object(), msg::object(), true);
         }
     });
 
-    return handler_table->store_context(context);
+    return msgid;
+}
+
+bool process::cancel(request_id request) {
+    std::lock_guard lock(*handler_table);
+    response_context *context = handler_table->take_context(request.msgid);
+
+    if (!context) {
+        return false;
+    }
+
+    handler_table->free_context(context);
+    return true;
+}
+
+void process::cancel(const cancellation_token &token) {
+    token.cancel();
+
+    if (token == cancellation_token()) {
+        return;
+    }
+
+    std::lock_guard lock(*handler_table);
+    const size_t size = handler_table->size();
+
+    for (size_t i=0; i<size; ++i) {
+        response_context *context = handler_table->slots[i].context;
+
+        if (context && context->token == token) {
+            handler_table->take_context(context->msgid);
+            handler_table->free_context(context);
+        }
+    }
 }
 
 process::process() {
@@ -149,6 +230,18 @@ process::process() {
     read_fd = -1;
     write_fd = -1;
     semaphore = dispatch_semaphore_create(0);
+    resize.timer = nullptr;
+    resize.pending = grid_size{};
+    resize.requested = grid_size{};
+    resize.current = grid_size{};
+    resize.flushes = 0;
+    resize.sent = 0;
+    resize.has_pending = false;
+    resize.in_flight = false;
+    resize.responded = false;
+    resize.resized = false;
+    ext_cmdline = false;
+    ext_messages = false;
 }
 
 process::~process() {
@@ -156,11 +249,13 @@ process::~process() {
 
     assert(dispatch_source_testcancel(read_source));
     assert(dispatch_source_testcancel(write_source));
+    assert(dispatch_source_testcancel(resize.timer));
     assert(read_fd != -1 && write_fd != -1);
 
     dispatch_release(queue);
     dispatch_release(read_source);
     dispatch_release(write_source);
+    dispatch_release(resize.timer);
     dispatch_release(semaphore);
     close(read_fd);
 
@@ -192,25 +287,141 @@ int process::spawn(const char *path, const char *argv[]) {
                    write_pipe.write_end.release());
 }
 
-int process::connect(std::string_view addr) {
-    if (addr.size() >= sizeof(sockaddr_un::sun_path)) {
-        return EINVAL;
+/// Connects to a Unix domain socket.
+/// @returns A connected socket, or -1 on failure, in which case errno is set.
+static int connect_unix(std::string_view path) {
+    if (path.size() >= sizeof(sockaddr_un::sun_path)) {
+        errno = EINVAL;
+        return -1;
     }
 
     int sock = socket(AF_UNIX, SOCK_STREAM, 0);
 
     if (sock == -1) {
-        return errno;
+        return -1;
     }
 
     fcntl(sock, F_SETFD, FD_CLOEXEC);
 
     sockaddr_un unaddr = {};
     unaddr.sun_family = AF_UNIX;
-    unaddr.sun_len = addr.size() + 1;
-    memcpy(unaddr.sun_path, addr.data(), addr.size());
+    unaddr.sun_len = path.size() + 1;
+    memcpy(unaddr.sun_path, path.data(), path.size());
 
     if (::connect(sock, (sockaddr*)&unaddr, sizeof(unaddr)) == -1) {
+        int error = errno;
+        close(sock);
+        errno = error;
+        return -1;
+    }
+
+    return sock;
+}
+
+/// Tunes a connected TCP socket for interactive RPC traffic.
+///
+/// Most of our messages are tiny (a single nvim_input call is a few dozen
+/// bytes) and latency sensitive, so Nagle's algorithm is disabled. Requests are
+/// packed as whole messages and everything queued is written with a single
+/// write() call, so messages that are queued together are still coalesced
+/// into the same segment. Redraw notifications can be large, so we use larger
+/// than default socket buffers. Keepalive probes detect dead remote hosts,
+/// which would otherwise leave the window hanging indefinitely.
+static void tune_tcp_socket(int sock) {
+    static constexpr int buffer_size = 256 * 1024;
+    static constexpr int keepalive_idle = 30;
+    static constexpr int keepalive_interval = 5;
+    static constexpr int keepalive_count = 4;
+
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(int));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(int));
+
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPALIVE,
+               &keepalive_idle, sizeof(int));
+
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL,
+               &keepalive_interval, sizeof(int));
+
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT,
+               &keepalive_count, sizeof(int));
+}
+
+/// Connects to a TCP socket.
+/// @param host The host name or address. IPv6 addresses may be bracketed.
+/// @param port The port number or service name.
+/// @returns A connected socket, or -1 on failure, in which case errno is set.
+static int connect_tcp(std::string_view host, std::string_view port) {
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    std::string hoststr(host);
+    std::string portstr(port);
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    addrinfo *addrs = nullptr;
+
+    if (getaddrinfo(hoststr.c_str(), portstr.c_str(), &hints, &addrs) != 0) {
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+
+    int error = ECONNREFUSED;
+    int sock = -1;
+
+    for (addrinfo *addr = addrs; addr; addr = addr->ai_next) {
+        sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+
+        if (sock == -1) {
+            error = errno;
+            continue;
+        }
+
+        fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+        if (::connect(sock, addr->ai_addr, addr->ai_addrlen) == 0) {
+            break;
+        }
+
+        error = errno;
+        close(sock);
+        sock = -1;
+    }
+
+    freeaddrinfo(addrs);
+
+    if (sock == -1) {
+        errno = error;
+        return -1;
+    }
+
+    tune_tcp_socket(sock);
+    return sock;
+}
+
+int process::connect(std::string_view addr) {
+    // Like Neovim's --server argument, addresses containing a path separator
+    // are Unix domain sockets. Otherwise host:port addresses are TCP sockets.
+    size_t colon = addr.rfind(':');
+    int sock;
+
+    if (addr.find('/') == std::string_view::npos &&
+        colon != std::string_view::npos && colon != 0) {
+        sock = connect_tcp(addr.substr(0, colon), addr.substr(colon + 1));
+    } else {
+        sock = connect_unix(addr);
+    }
+
+    if (sock == -1) {
         return errno;
     }
 
@@ -238,12 +449,13 @@ int process::io_init(int readfd, int writefd) {
     write_fd = writefd;
     queue = dispatch_queue_create(nullptr, DISPATCH_QUEUE_SERIAL);
 
-    // Response contexts may be referenced by dispatch_after blocks (timeout
-    // handlers), which can outlive the process object. To prevent dangling
-    // references, we heap allocate the response_handler_table and free it when
-    // we can be sure no timeout handlers are remaining.
+    // The handler table is used by dispatch_after blocks (timeout handlers),
+    // which can outlive the process object. To prevent dangling references,
+    // we heap allocate the response_handler_table, attach it to the queue, and
+    // free it when we can be sure no timeout handlers are remaining.
     handler_table = new response_handler_table;
     dispatch_set_context(queue, handler_table);
+    dispatch_queue_set_specific(queue, &handler_table_key, handler_table, nullptr);
     dispatch_set_finalizer_f(queue, [](void *context) {
         delete static_cast<response_handler_table*>(context);
     });
@@ -267,6 +479,7 @@ int process::io_init(int readfd, int writefd) {
 
     dispatch_source_set_cancel_handler_f(read_source, [](void *context) {
         process *ptr = static_cast<process*>(context);
+        dispatch_source_cancel(ptr->resize.timer);
         ptr->ui.shutdown();
     });
 
@@ -276,6 +489,18 @@ int process::io_init(int readfd, int writefd) {
         ptr->read_state = dispatch_source_state::cancelled;
     });
 
+    // The resize timer is armed whenever a resize request is sent.
+    resize.timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+    dispatch_set_context(resize.timer, this);
+
+    dispatch_source_set_event_handler_f(resize.timer, [](void *context) {
+        static_cast<process*>(context)->on_resize_timeout();
+    });
+
+    dispatch_source_set_timer(resize.timer, DISPATCH_TIME_FOREVER,
+                              DISPATCH_TIME_FOREVER, 0);
+
+    dispatch_resume(resize.timer);
     dispatch_resume(read_source);
     read_state = dispatch_source_state::resumed;
     write_state = dispatch_source_state::suspended;
@@ -366,39 +591,30 @@ void process::on_rpc_message(const msg::object &obj) {
 }
 
 void process::on_rpc_response(msg::array array) {
-    size_t msgid = array[1].get<msg::integer>();
+    uint32_t msgid = array[1].get<msg::integer>().as<uint32_t>();
 
     if (msgid == null_msgid) {
         return;
     }
 
-    std::lock_guard lock(*handler_table);
-
-    if (!handler_table->has_handler(msgid)) {
-        return os_log_error(rpc, "No response handler - ID=%zu, Response=%s",
-                            msgid, msg::to_string(array).c_str());
-    }
+    std::unique_lock lock(*handler_table);
+    response_context *context = handler_table->take_context(msgid);
 
-    response_context *context = handler_table->get(msgid);
-
-    // If we've timed out, the response came too late. Free and return.
-    if (context->timed_out) {
-        handler_table->free_context(context);
+    // The request timed out, or it was cancelled. The response came too late.
+    if (!context) {
         return;
     }
 
-    // We haven't timed out. Call the handler then overwrite it. Overwriting
-    // the handler here allows us to free any resources it may be referencing.
-    context->handler(array[2], array[3], false);
-    context->handler = response_handler();
+    // Move the handler out of the context, so we can call it without holding
+    // the lock. Handlers are then free to make further requests.
+    response_handler handler = std::move(context->handler);
+    cancellation_token token = std::move(context->token);
 
-    // If the context has an associated time out, there's still a dispatch_after
-    // block that's coming. Mark it as complete and let the timeout handler
-    // free it. If there's no time out, we're done, free it now.
-    if (context->has_timeout) {
-        context->complete = true;
-    } else {
-        handler_table->free_context(context);
+    handler_table->free_context(context);
+    lock.unlock();
+
+    if (!token.cancelled()) {
+        handler(array[2], array[3], false);
     }
 }
 
@@ -407,7 +623,13 @@ void process::on_rpc_notification(msg::array array) {
     msg::array args = array[2].get<msg::array>();
 
     if (name == "redraw") {
-        return ui.redraw(args);
+        ui.redraw(args);
+
+        if (ui.resize_flushes() != resize.flushes) {
+            on_resize_flush();
+        }
+
+        return;
     } else if (name == "vimenter") {
         return ui.vimenter();
     }
@@ -547,13 +769,25 @@ void process::set_controller(window_controller window) {
     ui.window = window;
 }
 
-static constexpr std::array<std::pair<msg::string, bool>, 1> attach_options{{
-    {"ext_linegrid", true}
-}};
+void process::set_ui_extensions(bool cmdline, bool messages) {
+    ext_cmdline = cmdline;
+    ext_messages = messages;
+}
+
+std::array<std::pair<msg::string, bool>, 5> process::attach_options() const {
+    // ext_messages implies ext_cmdline.
+    return {{
+        {"ext_linegrid", true},
+        {"ext_multigrid", true},
+        {"ext_popupmenu", true},
+        {"ext_cmdline", ext_cmdline || ext_messages},
+        {"ext_messages", ext_messages}
+    }};
+}
 
 void process::ui_attach(size_t width, size_t height) {
     ui.signal_on_flush(semaphore);
-    rpc_request(null_msgid, "nvim_ui_attach", width, height, attach_options);
+    rpc_request(null_msgid, "nvim_ui_attach", width, height, attach_options());
     dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
 }
 
@@ -564,7 +798,7 @@ void process::ui_attach_wait(size_t width, size_t height,
     rpc_request(null_msgid, "nvim_command",
                 "autocmd VimEnter * call rpcnotify(1, 'vimenter')");
 
-    rpc_request(null_msgid, "nvim_ui_attach", width, height, attach_options);
+    rpc_request(null_msgid, "nvim_ui_attach", width, height, attach_options());
 
     if (!dispatch_semaphore_wait(semaphore, timeout)) {
         return;
@@ -584,8 +818,145 @@ void process::ui_attach_wait(size_t width, size_t height,
     dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
 }
 
+std::shared_ptr<const grid_snapshot> process::get_snapshot() {
+    struct context {
+        process *self;
+        std::shared_ptr<const grid_snapshot> snapshot;
+    } ctx = {this, nullptr};
+
+    // Snapshots are taken on the queue handling redraw events, between event
+    // batches, so the flushed grid isn't handed back for writing mid snapshot.
+    dispatch_sync_f(queue, &ctx, [](void *ptr) {
+        context *ctx = static_cast<context*>(ptr);
+        ctx->snapshot = ctx->self->ui.get_snapshot();
+    });
+
+    return ctx.snapshot;
+}
+
+// Resize coalescing
+//
+// While a window is being live resized, we get a resize request on every
+// frame. Neovim handles each nvim_ui_try_resize call by resizing and redrawing
+// the entire grid. If we sent every request, Neovim would fall further and
+// further behind, redrawing sizes that are long out of date.
+//
+// Instead, we only allow one resize request to be in flight at a time.
+// Requests made while another request is in flight overwrite the pending size,
+// which is sent once the in flight request completes. This way, at most one
+// stale size is redrawn. Requests for the current grid size are dropped.
+//
+// A request is complete when either:
+//   1. Neovim responds, and the grid already has the requested size.
+//   2. Neovim responds, and a flush containing a grid_resize has been
+//      received. Neovim may flush before or after it responds.
+//   3. Neovim responds with an error.
+//   4. Neither happens within resize_timeout.
+//
+// Neovim doesn't always redraw after a resize. Requested sizes may be clamped,
+// or deferred, e.g. at a hit-enter prompt. The timeout ensures we never wait
+// on a grid_resize that isn't coming, which would strand the pending size.
+static constexpr int64_t resize_timeout = 500 * NSEC_PER_MSEC;
+
 void process::try_resize(size_t width, size_t height) {
-    rpc_request(null_msgid, "nvim_ui_try_resize", width, height);
+    grid_size size{(int32_t)width, (int32_t)height};
+    std::unique_lock lock(resize.lock);
+
+    if (resize.in_flight) {
+        resize.pending = size;
+        resize.has_pending = size != resize.requested;
+        return;
+    }
+
+    if (size == resize.current) {
+        return;
+    }
+
+    resize.in_flight = true;
+    lock.unlock();
+    send_resize(size);
+}
+
+/// Sends a resize request. Precondition: resize.in_flight is set.
+void process::send_resize(grid_size size) {
+    uint64_t request;
+
+    {
+        std::lock_guard lock(resize.lock);
+        request = ++resize.sent;
+        resize.requested = size;
+        resize.responded = false;
+        resize.resized = false;
+    }
+
+    dispatch_source_set_timer(resize.timer,
+                              dispatch_time(DISPATCH_TIME_NOW, resize_timeout),
+                              DISPATCH_TIME_FOREVER, 10 * NSEC_PER_MSEC);
+
+    uint32_t msgid = store_handler([this, request](const msg::object &error,
+                                                   const msg::object &result,
+                                                   bool timed_out) {
+        on_resize_response(request, !error.is<msg::null>());
+    });
+
+    rpc_request(msgid, "nvim_ui_try_resize", size.width, size.height);
+}
+
+/// Marks the in flight resize request as complete and sends the pending size,
+/// if there is one. Precondition: lock holds resize.lock.
+void process::resize_complete(std::unique_lock<unfair_lock> &lock) {
+    if (!resize.has_pending || resize.pending == resize.current) {
+        resize.has_pending = false;
+        resize.in_flight = false;
+        return;
+    }
+
+    grid_size size = resize.pending;
+    resize.has_pending = false;
+
+    lock.unlock();
+    send_resize(size);
+}
+
+void process::on_resize_response(uint64_t request, bool error) {
+    std::unique_lock lock(resize.lock);
+
+    // A late response to a request that timed out.
+    if (!resize.in_flight || request != resize.sent) {
+        return;
+    }
+
+    resize.responded = true;
+
+    if (error || resize.resized || resize.requested == resize.current) {
+        resize_complete(lock);
+    }
+}
+
+void process::on_resize_flush() {
+    std::unique_lock lock(resize.lock);
+    resize.flushes = ui.resize_flushes();
+    resize.current = ui.flushed_grid_size();
+
+    if (!resize.in_flight) {
+        return;
+    }
+
+    resize.resized = true;
+
+    if (resize.responded) {
+        resize_complete(lock);
+    }
+}
+
+void process::on_resize_timeout() {
+    std::unique_lock lock(resize.lock);
+
+    if (resize.in_flight) {
+        os_log_info(rpc, "Resize request timed out - Width=%d, Height=%d",
+                    resize.requested.width, resize.requested.height);
+        resize_complete(lock);
+    }
 }
 
 void process::input(std::string_view input) {
@@ -600,19 +971,32 @@ void process::command(std::string_view command) {
     rpc_request(null_msgid, "nvim_command", command);
 }
 
-void process::command(std::string_view command, response_handler handler) {
-    auto msgid = store_handler(std::move(handler));
+request_id process::command(std::string_view command,
+                            response_handler handler,
+                            const cancellation_token &token) {
+    if (token.cancelled()) {
+        return request_id{null_msgid};
+    }
+
+    auto msgid = store_handler(std::move(handler), token);
     rpc_request(msgid, "nvim_command", command);
+    return request_id{msgid};
 }
 
 void process::paste(std::string_view data) {
     rpc_request(null_msgid, "nvim_paste", data, false, -1);
 }
 
-void process::eval(std::string_view expr,
-                   dispatch_time_t timeout, response_handler handler) {
-    auto id = store_handler(timeout, std::move(handler));
+request_id process::eval(std::string_view expr,
+                         dispatch_time_t timeout, response_handler handler,
+                         const cancellation_token &token) {
+    if (token.cancelled()) {
+        return request_id{null_msgid};
+    }
+
+    auto id = store_handler(timeout, std::move(handler), token);
     rpc_request(id, "nvim_eval", expr);
+    return request_id{id};
 }
 
 void process::error_writeln(std::string_view error) {
@@ -620,9 +1004,10 @@ void process::error_writeln(std::string_view error) {
 }
 
 void process::input_mouse(std::string_view button, std::string_view action,
-                          std::string_view modifiers, size_t row, size_t col) {
-    rpc_request(null_msgid, "nvim_input_mouse",
-                button, action, modifiers, 0, row, col);
+                          std::string_view modifiers,
+                          const grid_location &location) {
+    rpc_request(null_msgid, "nvim_input_mouse", button, action, modifiers,
+                location.grid, location.row, location.col);
 }
 
 void process::drop_text(const std::vector<std::string_view> &text) {
@@ -630,16 +1015,79 @@ void process::drop_text(const std::vector<std::string_view> &text) {
                 std::tuple<const std::vector<std::string_view>&>(text));
 }
 
+// Opening files is implemented in Lua. The Lua chunk builds a table mapping
+// buffer names to buffer handles, then resolves every path with a single table
+// lookup. The Vimscript equivalent, calling bufnr() per path, is quadratic in
+// the number of buffers times the number of paths.
+//
+// Arguments:
+//   1. A list of absolute file paths.
+//   2. A boolean, if true the files are opened, otherwise they're only counted.
+//
+// Returns the number of paths that were open before the call.
+static constexpr std::string_view open_files_lua = R"lua(
+local paths, open = ...
+local api = vim.api
+local buffers = {}
+
+for _, buf in ipairs(api.nvim_list_bufs()) do
+    buffers[api.nvim_buf_get_name(buf)] = buf
+end
+
+local count = 0
+
+for _, path in ipairs(paths) do
+    if buffers[path] then
+        count = count + 1
+    end
+end
+
+if not open then
+    return count
+end
+
+local edit = api.nvim_eval('bufnr("$") == 1 && line("$") == 1 && ' ..
+                           'bufname(1) == "" && getline(1) == ""') == 1
+
+for _, path in ipairs(paths) do
+    local buf = buffers[path]
+    local windows = buf and api.nvim_call_function('win_findbuf', {buf}) or {}
+    local escaped = api.nvim_call_function('fnameescape', {path})
+
+    if edit then
+        edit = false
+        api.nvim_command('edit ' .. escaped)
+        buffers[path] = api.nvim_get_current_buf()
+    elseif #windows == 0 then
+        api.nvim_command('tabedit ' .. escaped)
+        buffers[path] = api.nvim_get_current_buf()
+    else
+        api.nvim_set_current_win(windows[1])
+    end
+end
+
+return count
+)lua";
+
 void process::open_tabs(const std::vector<std::string_view> &paths) {
-    rpc_request(null_msgid, "nvim_call_function", "neovim_mac#OpenTabs",
-                std::tuple<const std::vector<std::string_view>&>(paths));
+    rpc_request(null_msgid, "nvim_execute_lua", open_files_lua,
+                std::tuple<const std::vector<std::string_view>&, bool>(
+                    paths, true));
 }
 
-void process::open_count(const std::vector<std::string_view> &paths,
-                         dispatch_time_t timeout, response_handler handler) {
-    auto msgid = store_handler(timeout, std::move(handler));
-    rpc_request(msgid, "nvim_call_function", "neovim_mac#OpenCount",
-                std::tuple<const std::vector<std::string_view>&>(paths));
+request_id process::open_count(const std::vector<std::string_view> &paths,
+                               dispatch_time_t timeout,
+                               response_handler handler,
+                               const cancellation_token &token) {
+    if (token.cancelled()) {
+        return request_id{null_msgid};
+    }
+
+    auto msgid = store_handler(timeout, std::move(handler), token);
+    rpc_request(msgid, "nvim_execute_lua", open_files_lua,
+                std::tuple<const std::vector<std::string_view>&, bool>(
+                    paths, false));
+    return request_id{msgid};
 }
 
 } // namespace nvim
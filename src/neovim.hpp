@@ -11,11 +11,15 @@
 #define NEOVIM_HPP
 
 #include <dispatch/dispatch.h>
-#include <functional>
+#include <atomic>
 #include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <vector>
 
+#include "inline_function.hpp"
 #include "msgpack.hpp"
 #include "unfair_lock.hpp"
 #include "ui.hpp"
@@ -30,9 +34,48 @@ namespace nvim {
 ///                     request timed out the values of error and result
 ///                     are undefined. If the request had no time out this value
 ///                     can be ignored.
-using response_handler = std::function<void(const msg::object &error,
-                                            const msg::object &result,
-                                            bool timed_out)>;
+///
+/// Response handlers are stored inline, so registering a handler whose
+/// captures fit in 48 bytes does not allocate.
+using response_handler = inline_function<void(const msg::object &error,
+                                              const msg::object &result,
+                                              bool timed_out)>;
+
+/// Returns a response_handler that decodes the result as a T.
+///
+/// The handler is called with a std::optional<T>, which is empty if an error
+/// occurred, the request timed out, or the result was not a T. Integral types
+/// are decoded from msg::integer, all other types should be msg types.
+///
+/// Example:
+///     nvim.eval("1 + 1", timeout, typed_handler<int64_t>([](auto result) {
+///         if (result) use_result(*result);
+///     }));
+template<typename T, typename Callable>
+response_handler typed_handler(Callable &&callable) {
+    return [callable = std::forward<Callable>(callable)](
+            const msg::object &error,
+            const msg::object &result,
+            bool timed_out) mutable {
+        if (timed_out || !error.is<msg::null>()) {
+            return callable(std::optional<T>());
+        }
+
+        if constexpr (!std::is_same_v<T, msg::boolean> &&
+                      std::is_integral_v<T>) {
+            if (result.is<msg::integer>()) {
+                return callable(std::optional<T>(
+                    result.get<msg::integer>().as<T>()));
+            }
+        } else {
+            if (result.is<T>()) {
+                return callable(std::optional<T>(result.get<T>()));
+            }
+        }
+
+        return callable(std::optional<T>());
+    };
+}
 
 /// Neovim modes. See nvim :help mode() for more information.
 enum class mode : uint64_t {
@@ -145,6 +188,83 @@ inline bool is_busy(nvim::mode mode) {
            mode == mode::unknown;
 }
 
+/// Cancels groups of RPC requests and bounds their deadlines.
+///
+/// Requests made with a token are cancelled when the token is cancelled. This
+/// includes requests made after the token was cancelled, which are never sent.
+/// Cancelled requests never have their response handlers called.
+///
+/// Tokens may carry a deadline. Requests made with a token time out no later
+/// than the token's deadline, regardless of the timeout they were given. Pass
+/// the same token to chained requests (requests made from within response
+/// handlers) to have the deadline and cancellation propagate down the chain.
+///
+/// Tokens are cheap to copy, copies share their cancellation state. Default
+/// constructed tokens have no state, they are never cancelled and have no
+/// deadline.
+class cancellation_token {
+private:
+    struct state {
+        std::atomic<bool> cancelled;
+        dispatch_time_t deadline;
+
+        explicit state(dispatch_time_t deadline):
+            cancelled(false), deadline(deadline) {}
+    };
+
+    std::shared_ptr<state> ptr;
+
+public:
+    cancellation_token() = default;
+
+    /// Returns a new token.
+    /// @param deadline The absolute deadline of requests made with the token.
+    static cancellation_token make(dispatch_time_t deadline =
+                                   DISPATCH_TIME_FOREVER) {
+        cancellation_token token;
+        token.ptr = std::make_shared<state>(deadline);
+        return token;
+    }
+
+    /// Marks the token as cancelled. Responses to outstanding requests are
+    /// dropped as they arrive. To release outstanding requests immediately,
+    /// use process::cancel().
+    void cancel() const {
+        if (ptr) ptr->cancelled = true;
+    }
+
+    /// True if the token has been cancelled, otherwise false.
+    bool cancelled() const {
+        return ptr && ptr->cancelled;
+    }
+
+    /// Returns the earlier of timeout and the token's deadline.
+    dispatch_time_t deadline(dispatch_time_t timeout = DISPATCH_TIME_FOREVER)
+        const {
+        return ptr ? std::min(timeout, ptr->deadline) : timeout;
+    }
+
+    /// True if both tokens share the same state, otherwise false.
+    bool operator==(const cancellation_token &other) const {
+        return ptr == other.ptr;
+    }
+
+    bool operator!=(const cancellation_token &other) const {
+        return ptr != other.ptr;
+    }
+};
+
+/// Identifies an outstanding RPC request. See process::cancel().
+struct request_id {
+    uint32_t msgid;
+
+    /// True if the request was made, false if it was never sent. Requests made
+    /// with cancelled tokens are never sent.
+    explicit operator bool() const {
+        return msgid != UINT32_MAX;
+    }
+};
+
 /// A Neovim RPC client. Represents a connection to a Neovim process.
 ///
 /// Only one remote connection should be established per process object. That is
@@ -160,28 +280,41 @@ private:
     struct response_handler_table;
 
     struct response_context {
-        response_handler_table *table;
         response_handler handler;
-        bool complete;
-        bool has_timeout;
-        bool timed_out;
+        cancellation_token token;
+        uint32_t msgid;
     };
 
     struct response_handler_table {
+        // Msgids are composed of a slot index and a slot generation. Slot
+        // generations are incremented every time a slot is vacated, so
+        // responses to vacated slots are detected with a single comparison.
+        static constexpr uint32_t slot_bits = 20;
+        static constexpr uint32_t slot_mask = (1 << slot_bits) - 1;
+        static constexpr uint32_t generation_mask = (1 << 11) - 1;
+
+        struct slot {
+            response_context *context;
+            uint32_t generation;
+        };
+
         unfair_lock table_lock;
         std::deque<response_context> contexts;
         std::vector<response_context*> freelist;
-        std::vector<response_context*> handler_table;
+        std::vector<slot> slots;
         size_t last_index;
 
         response_handler_table():
-            handler_table(16),
+            slots(16),
             last_index(0) {}
 
         response_context* alloc_context();
         uint32_t store_context(response_context *context);
+        response_context* take_context(uint32_t msgid);
 
         void free_context(response_context *context) {
+            context->handler = nullptr;
+            context->token = cancellation_token();
             freelist.push_back(context);
         }
 
@@ -193,14 +326,8 @@ private:
             table_lock.unlock();
         }
 
-        bool has_handler(size_t msgid) {
-            return msgid < handler_table.size() && handler_table[msgid];
-        }
-
-        response_context* get(size_t msgid) {
-            response_context *context = handler_table[msgid];
-            handler_table[msgid] = nullptr;
-            return context;
+        size_t size() const {
+            return slots.size();
         }
     };
 
@@ -211,6 +338,25 @@ private:
         cancelled
     };
 
+    /// Coalesces nvim_ui_try_resize requests. See try_resize().
+    ///
+    /// At most one resize request is in flight at any time. Requests made
+    /// while another is in flight replace the pending size, which is sent on
+    /// completion.
+    struct resize_state {
+        unfair_lock lock;
+        dispatch_source_t timer;
+        grid_size pending;
+        grid_size requested;
+        grid_size current;
+        uint64_t flushes;
+        uint64_t sent;
+        bool has_pending;
+        bool in_flight;
+        bool responded;
+        bool resized;
+    };
+
     nvim::ui_controller ui;
     dispatch_queue_t queue;
     dispatch_source_t read_source;
@@ -225,6 +371,9 @@ private:
     msg::unpacker unpacker;
     unfair_lock write_lock;
     response_handler_table *handler_table;
+    resize_state resize;
+    bool ext_cmdline;
+    bool ext_messages;
 
     int  io_init(int readfd, int writefd);
     void io_can_read();
@@ -232,13 +381,25 @@ private:
     void io_error();
     void io_cancel();
 
-    uint32_t store_handler(response_handler &&handler);
-    uint32_t store_handler(dispatch_time_t timeout, response_handler &&handler);
+    uint32_t store_handler(response_handler &&handler,
+                           const cancellation_token &token = {});
+
+    uint32_t store_handler(dispatch_time_t timeout,
+                           response_handler &&handler,
+                           const cancellation_token &token = {});
 
     void on_rpc_message(const msg::object &obj);
     void on_rpc_response(msg::array obj);
     void on_rpc_notification(msg::array obj);
 
+    void send_resize(grid_size size);
+    void resize_complete(std::unique_lock<unfair_lock> &lock);
+    void on_resize_response(uint64_t request, bool error);
+    void on_resize_flush();
+    void on_resize_timeout();
+
+    std::array<std::pair<msg::string, bool>, 5> attach_options() const;
+
     template<typename ...Args>
     void rpc_request(uint32_t id, std::string_view method, const Args& ...args);
 
@@ -255,19 +416,32 @@ public:
         return ui.get_global_grid();
     }
 
+    /// Returns a snapshot of the most recently flushed global grid.
+    /// Blocks until the redraw events currently being handled are done.
+    /// @see ui_controller::get_snapshot().
+    std::shared_ptr<const nvim::grid_snapshot> get_snapshot();
+
     /// Returns the current Neovim options.
     nvim::options get_options() {
         return ui.get_options();
     }
 
-    /// Returns the Neovim window title.
-    std::string get_title() {
-        return ui.get_title();
+    /// Returns read access to the Neovim window title and options.
+    /// Never blocks, keep the returned reader short lived.
+    nvim::option_reader read_options() {
+        return ui.read_options();
     }
 
-    /// Returns the guifont option.
-    std::string get_guifont() {
-        return ui.get_guifont();
+    /// Returns a copy of the redraw event statistics.
+    /// @see ui_controller::get_redraw_stats().
+    nvim::redraw_stats get_redraw_stats() {
+        return ui.get_redraw_stats();
+    }
+
+    /// Enables or disables redraw event tracing.
+    /// @see ui_controller::trace_redraw_events().
+    void trace_redraw_events(bool enabled, uint64_t slow_threshold) {
+        ui.trace_redraw_events(enabled, slow_threshold);
     }
 
     /// Set the window controller.
@@ -281,16 +455,29 @@ public:
     /// @returns An errno code if an error occurred, 0 if no error occurred.
     int spawn(const char *path, const char *argv[]);
 
-    /// Connect to an existing Neovim process via a Unix domain socket.
+    /// Connect to an existing Neovim process.
+    /// @param addr Either the path to a Unix domain socket, or a TCP address
+    ///             in the form host:port. Addresses containing a '/' are
+    ///             always treated as paths.
     /// @returns An errno code if an error occurred, 0 if no error occurred.
     int connect(std::string_view addr);
 
+    /// Sets the optional UI extensions enabled by ui_attach.
+    /// @param cmdline  Enable ext_cmdline. The command line is reported by
+    ///                 grid::cmdline() rather than drawn to the grid.
+    /// @param messages Enable ext_messages, which implies ext_cmdline.
+    ///                 Messages are reported by grid::messages().
+    /// Note: Only takes effect if called before attaching.
+    void set_ui_extensions(bool cmdline, bool messages);
+
     /// Synchronously attaches to the remote UI process.
     /// @param width    Requested screen columns.
     /// @param height   Requested screen rows.
     /// Blocks until the first UI flush event. Once this function returns, the
     /// first grid is ready to be drawn. Attaches using nvim_ui_attach with
-    /// ext_linegrid enabled and all other ext options disabled.
+    /// ext_linegrid, ext_multigrid, and ext_popupmenu enabled, ext_cmdline and
+    /// ext_messages as set by set_ui_extensions(), and all other ext options
+    /// disabled.
     void ui_attach(size_t width, size_t height);
 
     /// Synchronously attach to the remote UI process and wait for VimEnter.
@@ -309,9 +496,15 @@ public:
     /// the --embed flag that are waiting for a UI to attach.
     void ui_attach_wait(size_t width, size_t height, dispatch_time_t timeout);
 
-    /// Calls API method nvim_try_resize. Resizes the global grid.
+    /// Calls API method nvim_ui_try_resize. Resizes the global grid.
     /// @param width    The new requested width.
     /// @param height   The new requested height.
+    ///
+    /// Resize requests are coalesced. If a previous request has not yet
+    /// completed, the new size is held back until it has, replacing any size
+    /// that is already waiting. Requests for the current grid size are
+    /// dropped. This avoids flooding Neovim with redundant resizes, and the
+    /// resulting redraws, during a live window resize.
     void try_resize(size_t width, size_t height);
 
     /// Calls API method nvim_input.
@@ -330,17 +523,20 @@ public:
 
     /// Calls API method nvim_command with a response handler.
     /// On execution error fails with VimL error, does not update v:errmsg.
-    /// No timeout is set on the request.
-    void command(std::string_view command, response_handler handler);
+    /// No timeout is set on the request, other than the token's deadline.
+    request_id command(std::string_view command, response_handler handler,
+                       const cancellation_token &token = {});
 
     /// Calls API method nvim_eval. Evaluates a VimL expression.
     /// @param expr     VimL expression.
     /// @param timeout  Request timeout.
     /// @param handler  The response handler. Error is the VimL error. Result
     ///                 is the evaulation result.
-    void eval(std::string_view expr,
-              dispatch_time_t timeout,
-              response_handler handler);
+    /// @param token    Cancellation token for the request.
+    request_id eval(std::string_view expr,
+                    dispatch_time_t timeout,
+                    response_handler handler,
+                    const cancellation_token &token = {});
 
     /// Calls API method nvim_paste. Pastes at cursor, in any mode.
     /// @param data Multi-line input, may be binary and contain NUL bytes.
@@ -367,6 +563,9 @@ public:
     ///   - If the file is open in another tab, switch to the tab and make it's
     ///     window active.
     ///   - Other wise open the file in a new tab.
+    ///
+    /// Paths are resolved against the buffer list in a single pass, so opening
+    /// many files at once costs one round trip and linear time.
     void open_tabs(const std::vector<std::string_view> &paths);
 
     /// Returns the current Neovim mode.
@@ -384,22 +583,35 @@ public:
     /// @param action   For non wheel mouse buttons, one of "press", "drag"
     ///                 or "release". For mouse wheel, pass the direction,
     ///                 "left", "right", "up", or "down".
-    /// @param row      Mouse row position.
-    /// @param col      Mouse column position.
+    /// @param location The mouse position. Obtain with grid::locate(), which
+    ///                 maps the position to a window grid with ext_multigrid.
     ///
     /// Note: All indexes are zero based.
     void input_mouse(std::string_view button,
                      std::string_view action,
                      std::string_view modifiers,
-                     size_t row, size_t col);
+                     const grid_location &location);
 
     /// Tests how many of the given files are currently open.
     /// @param paths    Absolute paths of the files to consider.
     /// @param timeout  The timeout for the request.
     /// @param handler  The response handler. On success the result object is
     ///                 an msg::integer representing the number of open files.
-    void open_count(const std::vector<std::string_view> &paths,
-                    dispatch_time_t timeout, response_handler handler);
+    /// @param token    Cancellation token for the request.
+    request_id open_count(const std::vector<std::string_view> &paths,
+                          dispatch_time_t timeout, response_handler handler,
+                          const cancellation_token &token = {});
+
+    /// Cancels an outstanding request.
+    ///
+    /// The request's response handler is destroyed without being called, and
+    /// its response is dropped if it arrives later on.
+    /// @returns True if the request was outstanding, otherwise false.
+    bool cancel(request_id request);
+
+    /// Cancels the token and every outstanding request made with it.
+    /// @see cancellation_token.
+    void cancel(const cancellation_token &token);
 };
 
 } // namesapce nvim
@@ -10,7 +10,25 @@
 #ifndef SHADER_TYPES_H
 #define SHADER_TYPES_H
 
+#if __has_include(<simd/simd.h>)
 #include <simd/simd.h>
+#else
+#include <cstdint>
+
+// Layout compatible stand ins for the simd types we use, so that frames can be
+// built on platforms without simd.h. See frame_builder.hpp.
+struct alignas(4) simd_short2 { int16_t x, y; };
+struct alignas(8) simd_short3 { int16_t x, y, z; };
+struct alignas(8) simd_float2 { float x, y; };
+
+inline simd_short2 simd_make_short2(int16_t x, int16_t y) {
+    return simd_short2{x, y};
+}
+
+inline simd_float2 simd_make_float2(float x, float y) {
+    return simd_float2{x, y};
+}
+#endif
 
 struct uniform_data {
     simd_float2 pixel_size;
@@ -21,7 +39,18 @@ struct uniform_data {
     uint32_t cursor_color;
     uint32_t cursor_line_width;
     uint32_t cursor_cell_width;
-    uint32_t grid_width;
+};
+
+/// A horizontal run of cells with the same background color.
+struct background_data {
+    simd_short2 grid_position;
+    uint32_t color;
+    uint32_t length;
+
+    background_data() = default;
+
+    background_data(simd_short2 grid_position, uint32_t color, uint32_t length):
+        grid_position(grid_position), color(color), length(length) {}
 };
 
 /// A rasterized glyph stored in a Metal texture.
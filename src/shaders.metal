@@ -50,16 +50,17 @@ constant float2 cursor_transforms[5][4] = {
 vertex extern grid_rasterizer_data background_render(uint vertex_id [[vertex_id]],
                                                      uint instance_id [[instance_id]],
                                                      constant uniform_data &uniforms [[buffer(0)]],
-                                                     constant uint32_t *cell_colors [[buffer(1)]]) {
-    uint32_t row = instance_id / uniforms.grid_width;
-    uint32_t col = instance_id % uniforms.grid_width;
+                                                     constant background_data *backgrounds [[buffer(1)]]) {
+    background_data background = backgrounds[instance_id];
 
-    float2 cell_vertex = float2(col, row) + transforms[vertex_id];
+    // Each instance is a run of cells, one cell high.
+    float2 size = float2(background.length, 1);
+    float2 cell_vertex = float2(background.grid_position) + (size * transforms[vertex_id]);
     float2 position = float2(-1, 1) + (uniforms.cell_size * cell_vertex);
 
     grid_rasterizer_data data;
     data.position = float4(position.xy, 0, 1);
-    data.color = unpack_unorm4x8_srgb_to_float(cell_colors[instance_id]);
+    data.color = unpack_unorm4x8_srgb_to_float(background.color);
     return data;
 }
 
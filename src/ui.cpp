@@ -8,6 +8,9 @@
 //
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <optional>
 #include <utility>
 #include <iostream>
 #include <type_traits>
@@ -92,6 +95,213 @@ T get(const msg::object &object) {
     }
 }
 
+/// A compile time perfect hash table that maps names to enum values.
+///
+/// The constructor searches for a hash seed that maps every name to a unique
+/// slot. A lookup is then a hash of the name's length and three of its
+/// characters, followed by a single string comparison. Names not in the table
+/// map to the unknown value.
+template<typename Enum, size_t Size>
+class name_table {
+private:
+    static_assert((Size & (Size - 1)) == 0, "Size must be a power of two");
+
+    struct entry {
+        std::string_view name;
+        Enum value;
+    };
+
+    entry entries[Size] = {};
+    Enum unknown = {};
+    uint32_t seed = 0;
+    bool perfect = false;
+
+    static constexpr size_t hash(uint32_t seed, std::string_view name) {
+        uint32_t hash = seed ^ static_cast<uint32_t>(name.size());
+        hash = (hash * 0x01000193) ^ static_cast<unsigned char>(name[0]);
+        hash = (hash * 0x01000193) ^
+               static_cast<unsigned char>(name[name.size() / 2]);
+        hash = (hash * 0x01000193) ^
+               static_cast<unsigned char>(name[name.size() - 1]);
+        return (hash ^ (hash >> 16)) & (Size - 1);
+    }
+
+public:
+    template<size_t N>
+    constexpr name_table(const std::pair<std::string_view, Enum> (&names)[N],
+                         Enum unknown): unknown(unknown) {
+        static_assert(N <= Size, "Too many names for table size");
+
+        for (uint32_t candidate = 0; candidate < 4096; ++candidate) {
+            for (entry &entry : entries) {
+                entry = {std::string_view(), unknown};
+            }
+
+            bool collision = false;
+
+            for (const auto &[name, value] : names) {
+                entry &entry = entries[hash(candidate, name)];
+
+                if (entry.name.size()) {
+                    collision = true;
+                    break;
+                }
+
+                entry = {name, value};
+            }
+
+            if (!collision) {
+                seed = candidate;
+                perfect = true;
+                return;
+            }
+        }
+    }
+
+    /// True if every name maps to a unique slot.
+    constexpr bool is_perfect() const {
+        return perfect;
+    }
+
+    /// Returns the value mapped to name, or the unknown value.
+    constexpr Enum find(std::string_view name) const {
+        if (!name.size()) {
+            return unknown;
+        }
+
+        const entry &entry = entries[hash(seed, name)];
+        return entry.name == name ? entry.value : unknown;
+    }
+};
+
+} // namespace
+
+enum class redraw_name : uint8_t {
+    grid_line,
+    grid_resize,
+    grid_scroll,
+    flush,
+    grid_clear,
+    hl_attr_define,
+    default_colors_set,
+    mode_info_set,
+    mode_change,
+    grid_cursor_goto,
+    set_title,
+    option_set,
+    mouse_on,
+    mouse_off,
+    set_icon,
+    hl_group_set,
+    grid_destroy,
+    win_pos,
+    win_float_pos,
+    win_external_pos,
+    win_hide,
+    win_close,
+    win_viewport,
+    msg_set_pos,
+    popupmenu_show,
+    popupmenu_select,
+    popupmenu_hide,
+    cmdline_show,
+    cmdline_pos,
+    cmdline_special_char,
+    cmdline_hide,
+    cmdline_block_show,
+    cmdline_block_append,
+    cmdline_block_hide,
+    msg_show,
+    msg_clear,
+    msg_showmode,
+    msg_showcmd,
+    msg_ruler,
+    msg_history_show,
+    msg_history_clear,
+    unknown
+};
+
+namespace {
+
+constexpr size_t redraw_name_count = static_cast<size_t>(redraw_name::unknown) + 1;
+
+constexpr std::pair<std::string_view, redraw_name> redraw_names[] = {
+    {"grid_line",            redraw_name::grid_line},
+    {"grid_resize",          redraw_name::grid_resize},
+    {"grid_scroll",          redraw_name::grid_scroll},
+    {"flush",                redraw_name::flush},
+    {"grid_clear",           redraw_name::grid_clear},
+    {"hl_attr_define",       redraw_name::hl_attr_define},
+    {"default_colors_set",   redraw_name::default_colors_set},
+    {"mode_info_set",        redraw_name::mode_info_set},
+    {"mode_change",          redraw_name::mode_change},
+    {"grid_cursor_goto",     redraw_name::grid_cursor_goto},
+    {"set_title",            redraw_name::set_title},
+    {"option_set",           redraw_name::option_set},
+    {"mouse_on",             redraw_name::mouse_on},
+    {"mouse_off",            redraw_name::mouse_off},
+    {"set_icon",             redraw_name::set_icon},
+    {"hl_group_set",         redraw_name::hl_group_set},
+    {"grid_destroy",         redraw_name::grid_destroy},
+    {"win_pos",              redraw_name::win_pos},
+    {"win_float_pos",        redraw_name::win_float_pos},
+    {"win_external_pos",     redraw_name::win_external_pos},
+    {"win_hide",             redraw_name::win_hide},
+    {"win_close",            redraw_name::win_close},
+    {"win_viewport",         redraw_name::win_viewport},
+    {"msg_set_pos",          redraw_name::msg_set_pos},
+    {"popupmenu_show",       redraw_name::popupmenu_show},
+    {"popupmenu_select",     redraw_name::popupmenu_select},
+    {"popupmenu_hide",       redraw_name::popupmenu_hide},
+    {"cmdline_show",         redraw_name::cmdline_show},
+    {"cmdline_pos",          redraw_name::cmdline_pos},
+    {"cmdline_special_char", redraw_name::cmdline_special_char},
+    {"cmdline_hide",         redraw_name::cmdline_hide},
+    {"cmdline_block_show",   redraw_name::cmdline_block_show},
+    {"cmdline_block_append", redraw_name::cmdline_block_append},
+    {"cmdline_block_hide",   redraw_name::cmdline_block_hide},
+    {"msg_show",             redraw_name::msg_show},
+    {"msg_clear",            redraw_name::msg_clear},
+    {"msg_showmode",         redraw_name::msg_showmode},
+    {"msg_showcmd",          redraw_name::msg_showcmd},
+    {"msg_ruler",            redraw_name::msg_ruler},
+    {"msg_history_show",     redraw_name::msg_history_show},
+    {"msg_history_clear",    redraw_name::msg_history_clear},
+};
+
+constexpr name_table<redraw_name, 128> redraw_table(redraw_names,
+                                                    redraw_name::unknown);
+static_assert(redraw_table.is_perfect());
+
+enum class option_name {
+    guifont,
+    ext_cmdline,
+    ext_hlstate,
+    ext_linegrid,
+    ext_messages,
+    ext_multigrid,
+    ext_popupmenu,
+    ext_tabline,
+    ext_termcolors,
+    unknown
+};
+
+constexpr std::pair<std::string_view, option_name> option_names[] = {
+    {"guifont",        option_name::guifont},
+    {"ext_cmdline",    option_name::ext_cmdline},
+    {"ext_hlstate",    option_name::ext_hlstate},
+    {"ext_linegrid",   option_name::ext_linegrid},
+    {"ext_messages",   option_name::ext_messages},
+    {"ext_multigrid",  option_name::ext_multigrid},
+    {"ext_popupmenu",  option_name::ext_popupmenu},
+    {"ext_tabline",    option_name::ext_tabline},
+    {"ext_termcolors", option_name::ext_termcolors},
+};
+
+constexpr name_table<option_name, 16> option_table(option_names,
+                                                   option_name::unknown);
+static_assert(option_table.is_perfect());
+
 template<typename ...Ts, size_t ...Indexes>
 void call(ui_controller &controller,
           void(ui_controller::*member_function)(Ts...),
@@ -138,90 +348,395 @@ void apply(ui_controller *controller,
 } // namespace
 
 grid* ui_controller::get_grid(size_t index) {
-    // We don't support ext_multigrid, so index should always be 1.
-    // If it isn't, we don't exaclty fail gracefully.
+    if (is_multigrid()) {
+        if (grid_layer *layer = get_layer(index)) {
+            return &layer->content;
+        }
+
+        return nullptr;
+    }
+
     if (index != 1) {
-        std::abort();
+        os_log_error(rpc, "Redraw error: Unknown grid - Grid=%zu", index);
+        return nullptr;
     }
-    
+
     return writing;
 }
 
-void ui_controller::redraw_event(const msg::object &event_object) {
-    const msg::array *event = event_object.get_if<msg::array>();
-    
-    if (!event || !event->size() || !event->at(0).is<msg::string>()) {
-        return os_log_error(rpc, "Redraw error: Event type error - Type=%s",
-                            msg::type_string(event_object).c_str());
+ui_controller::grid_layer* ui_controller::get_layer(size_t index) {
+    auto iter = layers.find(index);
+
+    if (iter == layers.end()) {
+        os_log_error(rpc, "Redraw error: Unknown grid - Grid=%zu", index);
+        return nullptr;
     }
 
-    // Neovim update events are arrays where:
-    //  - The first element is the event name
-    //  - The remainining elements are an array of argument tuples.
-    msg::string name = event->at(0).get<msg::string>();
-    msg::array args = event->subarray(1);
-    
-    if (name == "grid_line") {
+    return &iter->second;
+}
+
+packed_cell ui_controller::make_cell(msg::string text, uint16_t hlid) {
+    packed_cell cell;
+    cell.hlid = hlid;
+
+    if (text.size() == 1 && *text.data() == ' ') {
+        return cell;
+    }
+
+    size_t size = std::min(text.size(), sizeof(grapheme_cluster));
+    cell.size = size;
+
+    if (size <= packed_cell::inline_capacity) {
+        memcpy(cell.text, text.data(), size);
+        return cell;
+    }
+
+    // Long graphemes are interned. New graphemes are appended to the writing
+    // grid's table, other grids pick them up when they're synced.
+    std::string_view grapheme(text.data(), size);
+    auto [iter, inserted] = grapheme_ids.try_emplace(std::string(grapheme),
+                                                     writing->graphemes.size());
+
+    if (inserted) {
+        grapheme_cluster &cluster = writing->graphemes.emplace_back();
+        memcpy(cluster.data(), grapheme.data(), size);
+    }
+
+    memcpy(cell.text, &iter->second, sizeof(uint32_t));
+    return cell;
+}
+
+void ui_controller::compact_graphemes() {
+    constexpr uint32_t unused = UINT32_MAX;
+    std::vector<uint32_t> remap(writing->graphemes.size(), unused);
+    std::vector<grapheme_cluster> compacted;
+
+    auto rewrite = [&](std::vector<packed_cell> &cells) {
+        for (packed_cell &cell : cells) {
+            if (!cell.is_interned()) {
+                continue;
+            }
+
+            uint32_t &index = remap[cell.intern_index()];
+
+            if (index == unused) {
+                index = static_cast<uint32_t>(compacted.size());
+                compacted.push_back(writing->graphemes[cell.intern_index()]);
+            }
+
+            memcpy(cell.text, &index, sizeof(uint32_t));
+        }
+    };
+
+    // Layers are composited into the writing grid, both refer to the
+    // writing grid's table.
+    rewrite(writing->cells);
+
+    for (auto &[id, layer] : layers) {
+        rewrite(layer.content.cells);
+    }
+
+    grapheme_ids.clear();
+
+    for (size_t i=0; i<compacted.size(); ++i) {
+        const grapheme_cluster &cluster = compacted[i];
+        size_t size = strnlen(cluster.data(), cluster.size());
+        grapheme_ids.emplace(std::string(cluster.data(), size), i);
+    }
+
+    writing->graphemes = std::move(compacted);
+    writing->graphemes_tick = writing->next_tick();
+    writing->set_dirty();
+
+    compact_graphemes_size = std::max(min_compact_graphemes,
+                                      writing->graphemes.size() * 2);
+}
+
+void ui_controller::redraw_event(redraw_name type, msg::string name,
+                                 msg::array args) {
+    switch (type) {
+    case redraw_name::grid_line:
         return apply(this, &ui_controller::grid_line, name, args);
-    } else if (name == "grid_resize") {
+    case redraw_name::grid_resize:
         return apply(this, &ui_controller::grid_resize, name, args);
-    } else if (name == "grid_scroll") {
+    case redraw_name::grid_scroll:
         return apply(this, &ui_controller::grid_scroll, name, args);
-    } else if (name == "flush") {
+    case redraw_name::flush:
         return apply(this, &ui_controller::flush, name, args);
-    } else if (name == "grid_clear") {
+    case redraw_name::grid_clear:
         return apply(this, &ui_controller::grid_clear, name, args);
-    } else if (name == "hl_attr_define") {
+    case redraw_name::hl_attr_define:
         return apply(this, &ui_controller::hl_attr_define, name, args);
-    } else if (name == "default_colors_set") {
+    case redraw_name::default_colors_set:
         return apply(this, &ui_controller::default_colors_set, name, args);
-    } else if (name == "mode_info_set") {
+    case redraw_name::mode_info_set:
         return apply(this, &ui_controller::mode_info_set, name, args);
-    } else if (name == "mode_change") {
+    case redraw_name::mode_change:
         return apply(this, &ui_controller::mode_change, name, args);
-    } else if (name == "grid_cursor_goto") {
+    case redraw_name::grid_cursor_goto:
         return apply(this, &ui_controller::grid_cursor_goto, name, args);
-    } else if (name == "set_title") {
+    case redraw_name::set_title:
         return apply(this, &ui_controller::set_title, name, args);
-    }
+    case redraw_name::grid_destroy:
+        return apply(this, &ui_controller::grid_destroy, name, args);
+    case redraw_name::win_pos:
+        return apply(this, &ui_controller::win_pos, name, args);
+    case redraw_name::win_float_pos:
+        return apply(this, &ui_controller::win_float_pos, name, args);
+    case redraw_name::win_hide:
+        return apply(this, &ui_controller::win_hide, name, args);
+    case redraw_name::win_close:
+        return apply(this, &ui_controller::win_close, name, args);
+    case redraw_name::msg_set_pos:
+        return apply(this, &ui_controller::msg_set_pos, name, args);
+    case redraw_name::hl_group_set:
+        return apply(this, &ui_controller::hl_group_set, name, args);
+    case redraw_name::popupmenu_show:
+        return apply(this, &ui_controller::popupmenu_show, name, args);
+    case redraw_name::popupmenu_select:
+        return apply(this, &ui_controller::popupmenu_select, name, args);
+    case redraw_name::popupmenu_hide:
+        return apply(this, &ui_controller::popupmenu_hide, name, args);
+    case redraw_name::cmdline_show:
+        return apply(this, &ui_controller::cmdline_show, name, args);
+    case redraw_name::cmdline_pos:
+        return apply(this, &ui_controller::cmdline_pos, name, args);
+    case redraw_name::cmdline_special_char:
+        return apply(this, &ui_controller::cmdline_special_char, name, args);
+    case redraw_name::cmdline_hide:
+        return apply(this, &ui_controller::cmdline_hide, name, args);
+    case redraw_name::cmdline_block_show:
+        return apply(this, &ui_controller::cmdline_block_show, name, args);
+    case redraw_name::cmdline_block_append:
+        return apply(this, &ui_controller::cmdline_block_append, name, args);
+    case redraw_name::cmdline_block_hide:
+        return apply(this, &ui_controller::cmdline_block_hide, name, args);
+    case redraw_name::msg_show:
+        return apply(this, &ui_controller::msg_show, name, args);
+    case redraw_name::msg_clear:
+        return apply(this, &ui_controller::msg_clear, name, args);
+    case redraw_name::msg_showmode:
+        return apply(this, &ui_controller::msg_showmode, name, args);
+    case redraw_name::msg_showcmd:
+        return apply(this, &ui_controller::msg_showcmd, name, args);
+    case redraw_name::msg_ruler:
+        return apply(this, &ui_controller::msg_ruler, name, args);
+    case redraw_name::msg_history_show:
+        return apply(this, &ui_controller::msg_history_show, name, args);
+    case redraw_name::msg_history_clear:
+        return apply(this, &ui_controller::msg_history_clear, name, args);
 
     // When options change, we should inform the delegate. Neovim tends to
     // send redundant option change events, so only call the delegate if the
     // options actually changed.
-    if (name == "option_set") {
-        std::lock_guard lock(option_lock);
-        options oldopts = opts;
+    case redraw_name::option_set: {
+        options oldopts = option_values.opts;
         apply(this, &ui_controller::set_option, name, args);
+        publish_options();
+
+        if (font_option_set && send_option_change()) {
+            window.font_set();
+        }
 
-        if (opts != oldopts && send_option_change()) {
+        if (option_values.opts != oldopts && send_option_change()) {
             window.options_set();
         }
-        
+
+        font_option_set = false;
         return;
     }
 
     // The following events are ignored for now.
-    if (name == "mouse_on" || name == "mouse_off"  ||
-        name == "set_icon" || name == "hl_group_set") {
+    case redraw_name::mouse_on:
+    case redraw_name::mouse_off:
+    case redraw_name::set_icon:
+    case redraw_name::win_external_pos:
+    case redraw_name::win_viewport:
         return;
+
+    case redraw_name::unknown:
+        break;
     }
-    
+
     os_log_info(rpc, "Redraw info: Unhandled event - Name=%.*s Args=%s",
                 (int)std::min(name.size(), 128ul), name.data(),
                 msg::to_string(args).c_str());
 }
 
 void ui_controller::redraw(msg::array events) {
-    for (const msg::object &event : events) {
-        redraw_event(event);
+    const bool trace = tracing.load(std::memory_order_relaxed);
+    const uint64_t threshold = slow_threshold.load(std::memory_order_relaxed);
+
+    for (const msg::object &event_object : events) {
+        const msg::array *event = event_object.get_if<msg::array>();
+
+        if (!event || !event->size() || !event->at(0).is<msg::string>()) {
+            os_log_error(rpc, "Redraw error: Event type error - Type=%s",
+                         msg::type_string(event_object).c_str());
+            continue;
+        }
+
+        // Neovim update events are arrays where:
+        //  - The first element is the event name
+        //  - The remainining elements are an array of argument tuples.
+        msg::string name = event->at(0).get<msg::string>();
+        msg::array args = event->subarray(1);
+        redraw_name type = redraw_table.find(name);
+
+        redraw_event_stats &stats = event_stats[static_cast<size_t>(type)];
+        stats.events += 1;
+        stats.tuples += args.size();
+
+        if (trace) {
+            stats.bytes += msg::packed_size(event_object);
+            traced_redraw_event(type, name, args, threshold);
+        } else {
+            redraw_event(type, name, args);
+        }
+
+        stats.cells += cells_written;
+        cells_written = 0;
+    }
+}
+
+void ui_controller::traced_redraw_event(redraw_name type, msg::string name,
+                                        msg::array args, uint64_t threshold) {
+    using clock = std::chrono::steady_clock;
+
+    uint64_t flushes = stats_flushes;
+    clock::time_point begin = clock::now();
+    redraw_event(type, name, args);
+
+    auto elapsed = std::chrono::nanoseconds(clock::now() - begin);
+    uint64_t nanoseconds = elapsed.count();
+
+    event_stats[static_cast<size_t>(type)].nanoseconds += nanoseconds;
+
+    if (threshold == 0 || nanoseconds < threshold) {
+        return;
+    }
+
+    // Slow events should be rare, so we can afford to summarize them here.
+    static constexpr size_t max_summary_size = 256;
+    std::string summary = args.size() ? msg::to_string(args[0]) : "";
+
+    if (summary.size() > max_summary_size) {
+        summary.resize(max_summary_size);
+        summary.append("...");
+    }
+
+    // Unknown events share a counter, but slow events keep their real name.
+    slow_redraw_event slow;
+    slow.name = std::string(name);
+    slow.tuples = args.size();
+    slow.bytes = msg::packed_size(args);
+    slow.nanoseconds = nanoseconds;
+    slow.flushes = flushes;
+    slow.summary = std::move(summary);
+
+    os_log_info(rpc, "Redraw info: Slow event - Name=%s, Microseconds=%llu, "
+                     "Tuples=%llu, Bytes=%llu, Flushes=%llu, Args=%s",
+                slow.name.c_str(), slow.nanoseconds / 1000, slow.tuples,
+                slow.bytes, slow.flushes, slow.summary.c_str());
+
+    std::lock_guard lock(stats_lock);
+    slow_events[slow_events_recorded % max_slow_events] = std::move(slow);
+    slow_events_recorded += 1;
+}
+
+void ui_controller::init_redraw_stats() {
+    event_stats.resize(redraw_name_count);
+
+    for (const auto &[name, type] : redraw_names) {
+        event_stats[static_cast<size_t>(type)].name = name;
+    }
+
+    event_stats[static_cast<size_t>(redraw_name::unknown)].name = "unknown";
+    published_stats = event_stats;
+}
+
+void ui_controller::publish_redraw_stats() {
+    std::lock_guard lock(stats_lock);
+    stats_flushes += 1;
+    std::copy(event_stats.begin(), event_stats.end(), published_stats.begin());
+}
+
+redraw_stats ui_controller::get_redraw_stats() {
+    redraw_stats stats;
+    stats.tracing = tracing.load(std::memory_order_relaxed);
+    stats.slow_threshold = slow_threshold.load(std::memory_order_relaxed);
+
+    std::lock_guard lock(stats_lock);
+    stats.events = published_stats;
+    stats.flushes = stats_flushes;
+
+    size_t count = std::min<uint64_t>(slow_events_recorded, max_slow_events);
+    stats.slow_events.reserve(count);
+
+    for (uint64_t i = slow_events_recorded - count; i < slow_events_recorded; ++i) {
+        stats.slow_events.push_back(slow_events[i % max_slow_events]);
+    }
+
+    return stats;
+}
+
+// Layers are drawn in ascending z order. Layers with the same z order are
+// drawn in order of creation.
+static constexpr long default_grid_zindex = 0;
+static constexpr long window_zindex = 1;
+static constexpr long float_zindex = 50;
+static constexpr long message_zindex = 200;
+
+void grid::resize(size_t width, size_t height) {
+    grid_width = width;
+    grid_height = height;
+    cells.resize(width * height);
+    row_slabs.resize(height);
+
+    for (size_t row=0; row<height; ++row) {
+        row_slabs[row] = static_cast<uint32_t>(row);
     }
+
+    row_ticks.resize(height);
+    row_hashes.resize(height);
+    set_dirty();
+    resize_tick = next_tick();
 }
 
 void ui_controller::grid_resize(size_t grid_id, size_t width, size_t height) {
-    grid *grid = get_grid(grid_id);
-    grid->grid_width = width;
-    grid->grid_height = height;
-    grid->cells.resize(width * height);
+    if (is_multigrid()) {
+        auto [iter, inserted] = layers.try_emplace(grid_id);
+        grid_layer &layer = iter->second;
+
+        if (inserted) {
+            layer.id = grid_id;
+            layer.row = 0;
+            layer.col = 0;
+            layer.zindex = window_zindex;
+            layer.order = layer_sequence++;
+            layer.visible = false;
+
+            // The default grid is always visible, underneath everything else.
+            if (grid_id == 1) {
+                layer.zindex = default_grid_zindex;
+                layer.visible = true;
+            }
+        }
+
+        layer.content.resize(width, height);
+        layout_changed = true;
+
+        // The composited grid is the same size as the default grid.
+        if (grid_id != 1) {
+            return;
+        }
+    } else if (grid_id != 1) {
+        return os_log_error(rpc, "Redraw error: Unknown grid - Grid=%zu",
+                            grid_id);
+    }
+
+    writing->resize(width, height);
+    grid_resized = true;
 }
 
 template<typename ...Ts>
@@ -230,19 +745,45 @@ static bool type_check(const msg::array &array) {
     return array.size() == sizeof...(Ts) && (array[index++].is<Ts>() && ...);
 }
 
+/// Fills count cells, starting at dest, with copies of value.
+/// Long runs are filled by repeatedly doubling the filled region with block
+/// copies, rather than storing one cell at a time.
+static inline void fill_cells(packed_cell *dest,
+                              const packed_cell &value, size_t count) {
+    if (count < 16) {
+        std::fill_n(dest, count, value);
+        return;
+    }
+
+    dest[0] = value;
+    size_t filled = 1;
+
+    while (filled < count) {
+        size_t size = std::min(filled, count - filled);
+        memcpy(dest + filled, dest, size * sizeof(packed_cell));
+        filled += size;
+    }
+}
+
 /// Represents a cell update from the grid_line event.
 struct cell_update {
     msg::string text;
-    const cell_attributes *hlattr;
+    uint16_t hlid;
     size_t repeat;
     
-    cell_update(): hlattr(nullptr), repeat(0) {}
+    cell_update(): hlid(0), repeat(0) {}
+
+    /// Highlight IDs that don't fit in a packed cell use the default
+    /// highlight attributes.
+    static uint16_t to_hlid(const msg::object &object) {
+        uint64_t hlid = object.get<msg::integer>().as<uint64_t>();
+        return hlid <= UINT16_MAX ? hlid : 0;
+    }
 
     /// Set the cell_update from a msg::object.
     /// @param object   An object from the cells array in a grid_line event.
-    /// @param hl_table  The highlight table.
     /// @returns True if object type checked correctly, otherwise false.
-    bool set(const msg::object &object, const highlight_table &hl_table) {
+    bool set(const msg::object &object) {
         if (!object.is<msg::array>()) {
             return false;
         }
@@ -257,14 +798,14 @@ struct cell_update {
         
         if (type_check<msg::string, msg::integer>(array)) {
             text = array[0].get<msg::string>();
-            hlattr = hl_get_entry(hl_table, array[1].get<msg::integer>());
+            hlid = to_hlid(array[1]);
             repeat = 1;
             return true;
         }
             
         if (type_check<msg::string, msg::integer, msg::integer>(array)) {
             text = array[0].get<msg::string>();
-            hlattr = hl_get_entry(hl_table, array[1].get<msg::integer>());
+            hlid = to_hlid(array[1]);
             repeat = array[2].get<msg::integer>();
             return true;
         }
@@ -276,24 +817,44 @@ struct cell_update {
 void ui_controller::grid_line(size_t grid_id, size_t row,
                               size_t col, msg::array cells) {
     grid *grid = get_grid(grid_id);
+
+    if (!grid) {
+        return;
+    }
     
     if (row >= grid->height() || col >= grid->width()) {
         return log_grid_out_of_bounds(grid, "grid_line", row, col);
     }
     
-    cell *rowbegin = grid->get(row, 0);
-    cell *cell = rowbegin + col;
+    packed_cell *rowbegin = grid->slot(row, 0);
+    packed_cell *cell = rowbegin + col;
+    grid->set_dirty(row);
     
     size_t remaining = grid->width() - col;
     cell_update update;
-    
-    for (const msg::object &object : cells) {
-        if (!update.set(object, hl_table)) {
+    packed_cell ascii;
+
+    // Single byte graphemes are stamped out from a template cell that shares
+    // their highlight. Spaces are stored with no text, like make_cell().
+    auto stamp = [&ascii](packed_cell *cell, char c) {
+        bool space = c == ' ';
+        *cell = ascii;
+        cell->text[0] = space ? 0 : c;
+        cell->size = !space;
+    };
+
+    const msg::object *object = cells.begin();
+    const msg::object *end = cells.end();
+
+    while (object != end) {
+        if (!update.set(*object)) {
             return os_log_error(rpc, "Redraw error: Cell update type error - "
                                      "Event=grid_line, Type=%s",
-                                     msg::type_string(object).c_str());
+                                     msg::type_string(*object).c_str());
         }
-        
+
+        object += 1;
+
         if (update.repeat > remaining) {
             return os_log_error(rpc, "Redraw error: Row overflow - "
                                      "Event=grid_line");
@@ -306,39 +867,80 @@ void ui_controller::grid_line(size_t grid_id, size_t row,
                 return;
             }
             
-            nvim::cell *left = cell - 1;
-            cell->attrs = left->attrs;
-            left->attrs.flags |= cell_attributes::doublewidth;
+            packed_cell *left = cell - 1;
+            *cell = packed_cell();
+            cell->hlid = left->hlid;
+            left->flags |= packed_cell::doublewidth;
 
             // Double width chars never repeat.
             cell += 1;
             remaining -= 1;
-        } else {
-            *cell = nvim::cell(update.text, update.hlattr);
+        } else if (update.text.size() == 1 && update.repeat == 1) {
+            ascii.hlid = update.hlid;
+            stamp(cell, update.text[0]);
 
-            for (int i=1; i<update.repeat; ++i) {
-                cell[i] = *cell;
+            cell += 1;
+            remaining -= 1;
+
+            // Single byte graphemes are the vast majority of cells, and they
+            // usually come in runs that share a highlight. Neovim encodes the
+            // rest of the run as [text], so we consume it here, without going
+            // through cell_update.
+            while (object != end && remaining) {
+                if (!object->is<msg::array>()) {
+                    break;
+                }
+
+                msg::array array = object->get<msg::array>();
+
+                if (array.size() != 1 || !array[0].is<msg::string>()) {
+                    break;
+                }
+
+                msg::string text = array[0].get<msg::string>();
+
+                if (text.size() != 1) {
+                    break;
+                }
+
+                stamp(cell, text[0]);
+                object += 1;
+                cell += 1;
+                remaining -= 1;
             }
+        } else {
+            fill_cells(cell, make_cell(update.text, update.hlid),
+                       update.repeat);
 
             cell += update.repeat;
             remaining -= update.repeat;
         }
     }
+
+    cells_written += grid->width() - col - remaining;
 }
 
 void ui_controller::grid_clear(size_t grid_id) {
     grid *grid = get_grid(grid_id);
 
-    cell empty;
-    empty.attrs.background = hl_table[0].background;
+    if (!grid) {
+        return;
+    }
 
-    for (cell &cell : grid->cells) {
-        cell = empty;
+    for (packed_cell &cell : grid->cells) {
+        cell = packed_cell();
     }
+
+    cells_written += grid->cells.size();
+    grid->set_dirty();
 }
 
 void ui_controller::grid_cursor_goto(size_t grid_id, size_t row, size_t col) {
     grid *grid = get_grid(grid_id);
+
+    if (!grid) {
+        return;
+    }
     
     if (row >= grid->height() || col >= grid->width()) {
         return os_log_error(rpc, "Redraw error: Cursor out of bounds - "
@@ -349,6 +951,8 @@ void ui_controller::grid_cursor_goto(size_t grid_id, size_t row, size_t col) {
     
     grid->cursor_row = row;
     grid->cursor_col = col;
+    grid->cursor_tick = grid->next_tick();
+    cursor_grid = grid_id;
 }
 
 void ui_controller::grid_scroll(size_t grid_id, size_t top, size_t bottom,
@@ -362,43 +966,493 @@ void ui_controller::grid_scroll(size_t grid_id, size_t top, size_t bottom,
     }
     
     grid *grid = get_grid(grid_id);
-    size_t height = bottom - top;
-    size_t width = right - left;
-    
+
+    if (!grid) {
+        return;
+    }
+
     if (bottom > grid->height() || right > grid->width()) {
         return log_grid_out_of_bounds(grid, "grid_scroll", bottom, right);
     }
     
-    long count;
-    long row_width;
-    cell *dest;
-    
+    grid->scroll(grid_scroll_region{grid->next_tick(),
+                                    top, bottom, left, right, rows});
+}
+
+void grid::scroll_cells(const grid_scroll_region &region) {
+    size_t height = region.bottom - region.top;
+    size_t width = region.right - region.left;
+    long rows = region.rows;
+    size_t distance = std::abs(rows);
+
+    // Full width scrolls rotate row slabs. Exposed rows are left with stale
+    // contents, Neovim redraws them with subsequent grid_line events.
+    if (width == grid_width) {
+        if (distance >= height) {
+            return;
+        }
+
+        auto begin = row_slabs.begin() + region.top;
+        auto end = row_slabs.begin() + region.bottom;
+        auto middle = rows >= 0 ? begin + distance : end - distance;
+        std::rotate(begin, middle, end);
+        return;
+    }
+
+    // Partial width scrolls copy cells between slabs.
+    size_t copy_size = sizeof(packed_cell) * width;
+
     if (rows >= 0) {
-        dest = grid->get(top, left);
-        row_width = grid->width();
-        count = height - rows;
+        for (size_t row=region.top; row + distance < region.bottom; ++row) {
+            memcpy(slot(row, region.left),
+                   slot(row + distance, region.left), copy_size);
+        }
     } else {
-        dest = grid->get(bottom - 1, left);
-        row_width = -grid->width();
-        count = height + rows;
+        for (size_t row=region.bottom; row-- > region.top + distance;) {
+            memcpy(slot(row, region.left),
+                   slot(row - distance, region.left), copy_size);
+        }
     }
+}
 
-    cell *src = dest + ((long)grid->width() * rows);
-    size_t copy_size = sizeof(cell) * width;
-    
-    for (long i=0; i<count; ++i) {
-        memcpy(dest, src, copy_size);
-        dest += row_width;
-        src += row_width;
+void grid::scroll(const grid_scroll_region &region) {
+    scroll_cells(region);
+
+    size_t top = region.top;
+    size_t bottom = region.bottom;
+    size_t height = bottom - top;
+    long rows = region.rows;
+    size_t distance = std::abs(rows);
+
+    // Partial width scrolls leave rows with mixed contents, so the whole
+    // region is modified. Rows exposed by the scroll are always modified.
+    if (region.left != 0 || region.right != grid_width || distance >= height) {
+        set_dirty(top, bottom);
+    } else if (rows > 0) {
+        std::copy(row_ticks.begin() + top + rows,
+                  row_ticks.begin() + bottom, row_ticks.begin() + top);
+        std::copy(row_hashes.begin() + top + rows,
+                  row_hashes.begin() + bottom, row_hashes.begin() + top);
+        set_dirty(bottom - distance, bottom);
+    } else {
+        std::copy_backward(row_ticks.begin() + top,
+                           row_ticks.begin() + bottom - distance,
+                           row_ticks.begin() + bottom);
+        std::copy_backward(row_hashes.begin() + top,
+                           row_hashes.begin() + bottom - distance,
+                           row_hashes.begin() + bottom);
+        set_dirty(top, top + distance);
+    }
+
+    grid_scroll_region &entry = scroll_log[scroll_count % scroll_log_size];
+
+    if (scroll_count >= scroll_log_size) {
+        scroll_dropped_tick = entry.tick;
+    }
+
+    entry = region;
+    scroll_count += 1;
+}
+
+void grid::update_row_hashes() {
+    static constexpr uint64_t multiplier = 0x9E3779B97F4A7C15;
+
+    for (size_t row=0; row<grid_height; ++row) {
+        if (row_ticks[row] <= draw_tick) {
+            continue;
+        }
+
+        const packed_cell *cell = slot(row, 0);
+        const packed_cell *end = cell + grid_width;
+        uint64_t hash = grid_width;
+
+        for (; cell != end; ++cell) {
+            static_assert(sizeof(packed_cell) == 12);
+            uint64_t text;
+            uint32_t rest;
+            memcpy(&text, cell, sizeof(text));
+            memcpy(&rest, (const char*)cell + sizeof(text), sizeof(rest));
+
+            hash = (hash ^ text) * multiplier;
+            hash = (hash ^ (hash >> 32) ^ rest) * multiplier;
+        }
+
+        row_hashes[row] = hash ^ (hash >> 29);
     }
 }
 
+grid_changes grid::changes_since(uint64_t tick) const {
+    grid_changes changes;
+    changes.full = tick > draw_tick ||
+                   resize_tick > tick ||
+                   scroll_dropped_tick > tick;
+    changes.cursor = cursor_tick > tick;
+    changes.popupmenu = popupmenu_tick > tick;
+    changes.cmdline = cmdline_tick > tick;
+    changes.messages = messages_tick > tick;
+    changes.highlights = highlight_tick > tick;
+
+    if (changes.full) {
+        changes.rows.resize(grid_height);
+
+        for (size_t row=0; row<grid_height; ++row) {
+            changes.rows[row] = row;
+        }
+
+        return changes;
+    }
+
+    uint64_t first = scroll_count - std::min(scroll_count, scroll_log_size);
+
+    for (uint64_t i=first; i<scroll_count; ++i) {
+        const grid_scroll_region &region = scroll_log[i % scroll_log_size];
+
+        if (region.tick > tick) {
+            changes.scrolls.push_back(region);
+        }
+    }
+
+    for (size_t row=0; row<grid_height; ++row) {
+        if (row_ticks[row] > tick) {
+            changes.rows.push_back(row);
+        }
+    }
+
+    return changes;
+}
+
+void grid::sync(const grid &src) {
+    if (grid_width != src.grid_width || grid_height != src.grid_height ||
+        src.resize_tick > draw_tick || src.scroll_dropped_tick > draw_tick) {
+        *this = src;
+        return;
+    }
+
+    uint64_t count = src.scroll_count;
+    uint64_t first = count - std::min(count, scroll_log_size);
+
+    for (uint64_t i=first; i<count; ++i) {
+        const grid_scroll_region &region = src.scroll_log[i % scroll_log_size];
+
+        if (region.tick > draw_tick) {
+            scroll_cells(region);
+        }
+    }
+
+    for (size_t row=0; row<grid_height; ++row) {
+        if (src.row_ticks[row] > draw_tick) {
+            const packed_cell *begin = src.slot(row, 0);
+            std::copy(begin, begin + grid_width, slot(row, 0));
+        }
+    }
+
+    if (src.highlight_tick > draw_tick) {
+        hl_table = src.hl_table;
+    }
+
+    if (src.layout_tick > draw_tick) {
+        window_list = src.window_list;
+    }
+
+    if (src.popupmenu_tick > draw_tick) {
+        pum = src.pum;
+    }
+
+    if (src.cmdline_tick > draw_tick) {
+        cmd = src.cmd;
+    }
+
+    if (src.messages_tick > draw_tick) {
+        msgs = src.msgs;
+    }
+
+    // The grapheme table is append only between compactions. Compacting
+    // dirties every row, so the rows copied above use the new indexes.
+    if (src.graphemes_tick > draw_tick) {
+        graphemes = src.graphemes;
+    } else {
+        graphemes.insert(graphemes.end(),
+                         src.graphemes.begin() + graphemes.size(),
+                         src.graphemes.end());
+    }
+
+    row_ticks = src.row_ticks;
+    row_hashes = src.row_hashes;
+    scroll_log = src.scroll_log;
+    scroll_count = src.scroll_count;
+    scroll_dropped_tick = src.scroll_dropped_tick;
+    resize_tick = src.resize_tick;
+    cursor_tick = src.cursor_tick;
+    popupmenu_tick = src.popupmenu_tick;
+    cmdline_tick = src.cmdline_tick;
+    messages_tick = src.messages_tick;
+    graphemes_tick = src.graphemes_tick;
+    highlight_tick = src.highlight_tick;
+    layout_tick = src.layout_tick;
+    cursor_attrs = src.cursor_attrs;
+    cursor_row = src.cursor_row;
+    cursor_col = src.cursor_col;
+    draw_tick = src.draw_tick;
+}
+
+void ui_controller::mark_layer_dirty(const grid_layer &layer) {
+    const grid &content = layer.content;
+    const long height = dirty_spans.size();
+    const uint64_t tick = content.draw_tick;
+
+    auto mark = [&](long row, long begin, long end) {
+        row += layer.row;
+
+        if (row >= 0 && row < height) {
+            auto &[span_begin, span_end] = dirty_spans[row];
+            span_begin = std::min(span_begin, layer.col + begin);
+            span_end = std::max(span_end, layer.col + end);
+        }
+    };
+
+    const long width = content.width();
+    const bool all = content.resize_tick > tick ||
+                     content.scroll_dropped_tick > tick;
+
+    // Rows moved by a scroll keep their row ticks, so the whole scroll
+    // region must be recomposited.
+    if (!all) {
+        uint64_t count = content.scroll_count;
+        uint64_t first = count - std::min(count, grid::scroll_log_size);
+
+        for (uint64_t i=first; i<count; ++i) {
+            const grid_scroll_region &region =
+                content.scroll_log[i % grid::scroll_log_size];
+
+            if (region.tick > tick) {
+                for (size_t row=region.top; row<region.bottom; ++row) {
+                    mark(row, region.left, region.right);
+                }
+            }
+        }
+    }
+
+    for (size_t row=0; row<content.height(); ++row) {
+        if (all || content.row_ticks[row] > tick) {
+            mark(row, 0, width);
+        }
+    }
+}
+
+void ui_controller::compose_row(long row, long begin, long end) {
+    grid *target = writing;
+    begin = std::max(begin, 0l);
+    end = std::min(end, (long)target->width());
+
+    if (begin >= end) {
+        return;
+    }
+
+    for (const grid_layer *layer : layer_order) {
+        const grid &content = layer->content;
+        long layer_row = row - layer->row;
+
+        if (layer_row < 0 || layer_row >= (long)content.height()) {
+            continue;
+        }
+
+        long layer_begin = std::max(begin, layer->col);
+        long layer_end = std::min(end, layer->col + (long)content.width());
+
+        if (layer_begin >= layer_end) {
+            continue;
+        }
+
+        const packed_cell *src = content.slot(layer_row,
+                                              layer_begin - layer->col);
+        std::copy(src, src + (layer_end - layer_begin),
+                  target->slot(row, layer_begin));
+    }
+
+    target->set_dirty(row);
+}
+
+void ui_controller::compose() {
+    grid *target = writing;
+    const long height = target->height();
+    const long width = target->width();
+
+    if (layout_changed) {
+        layer_order.clear();
+
+        for (auto &[id, layer] : layers) {
+            if (layer.visible) {
+                layer_order.push_back(&layer);
+            }
+        }
+
+        std::sort(layer_order.begin(), layer_order.end(),
+                  [](const grid_layer *left, const grid_layer *right) {
+            if (left->zindex != right->zindex) {
+                return left->zindex < right->zindex;
+            }
+
+            return left->order < right->order;
+        });
+
+        target->window_list.clear();
+
+        for (const grid_layer *layer : layer_order) {
+            target->window_list.push_back(grid_window{
+                layer->id, layer->row, layer->col,
+                layer->content.width(), layer->content.height()
+            });
+        }
+
+        target->layout_tick = target->next_tick();
+        dirty_spans.assign(height, std::pair(0l, width));
+        layout_changed = false;
+    } else {
+        dirty_spans.assign(height, std::pair(width, 0l));
+
+        for (const grid_layer *layer : layer_order) {
+            mark_layer_dirty(*layer);
+        }
+    }
+
+    for (long row=0; row<height; ++row) {
+        auto [begin, end] = dirty_spans[row];
+
+        if (begin < end) {
+            compose_row(row, begin, end);
+        }
+    }
+
+    // Layers are single buffered, their draw ticks just mark what's already
+    // been composited.
+    for (auto &[id, layer] : layers) {
+        layer.content.draw_tick += 1;
+    }
+
+    auto iter = layers.find(cursor_grid);
+
+    if (iter != layers.end() && iter->second.visible) {
+        const grid_layer &layer = iter->second;
+        long row = layer.row + (long)layer.content.cursor_row;
+        long col = layer.col + (long)layer.content.cursor_col;
+
+        if (row >= 0 && row < height && col >= 0 && col < width &&
+            (row != (long)target->cursor_row ||
+             col != (long)target->cursor_col)) {
+            target->cursor_row = row;
+            target->cursor_col = col;
+            target->cursor_tick = target->next_tick();
+        }
+    }
+}
+
+void ui_controller::update_snapshot(const grid &src) {
+    std::shared_ptr<const grid_snapshot> prev = snapshot;
+    auto next = std::make_shared<grid_snapshot>();
+    grid_changes changes;
+
+    if (prev) {
+        changes = src.changes_since(prev->draw_tick);
+        next->rows = prev->rows;
+        next->hl_table = prev->hl_table;
+        next->graphemes = prev->graphemes;
+        next->window_list = prev->window_list;
+    } else {
+        changes.full = true;
+        changes.highlights = true;
+    }
+
+    if (changes.full) {
+        next->rows.assign(src.grid_height, nullptr);
+        changes.rows.resize(src.grid_height);
+
+        for (size_t row=0; row<src.grid_height; ++row) {
+            changes.rows[row] = row;
+        }
+    }
+
+    // Full width scrolls move rows without modifying them, so we move the
+    // shared rows. Other scrolls mark their whole region as modified.
+    for (const grid_scroll_region &region : changes.scrolls) {
+        size_t height = region.bottom - region.top;
+        size_t distance = std::abs(region.rows);
+
+        if (region.right - region.left == src.grid_width && distance < height) {
+            auto begin = next->rows.begin() + region.top;
+            auto end = next->rows.begin() + region.bottom;
+            auto middle = region.rows >= 0 ? begin + distance : end - distance;
+            std::rotate(begin, middle, end);
+        }
+    }
+
+    for (size_t row : changes.rows) {
+        const packed_cell *begin = src.slot(row, 0);
+        next->rows[row] = std::make_shared<grid_snapshot::row>(
+            begin, begin + src.grid_width);
+    }
+
+    if (changes.highlights || changes.full) {
+        next->hl_table = std::make_shared<std::vector<cell_attributes>>(
+            src.hl_table);
+    }
+
+    if (!next->graphemes || next->graphemes->size() != src.graphemes.size() ||
+        src.graphemes_tick > prev->draw_tick) {
+        next->graphemes = std::make_shared<std::vector<grapheme_cluster>>(
+            src.graphemes);
+    }
+
+    if (!prev || src.layout_tick > prev->draw_tick) {
+        next->window_list = src.window_list;
+    }
+
+    next->row_hashes = src.row_hashes;
+    next->pum = src.pum;
+    next->cmd = src.cmd;
+    next->msgs = src.msgs;
+    next->grid_width = src.grid_width;
+    next->grid_height = src.grid_height;
+    next->cursor_attrs = src.cursor_attrs;
+    next->cursor_row = src.cursor_row;
+    next->cursor_col = src.cursor_col;
+    next->draw_tick = src.draw_tick;
+
+    snapshot = std::move(next);
+}
+
+std::shared_ptr<const grid_snapshot> ui_controller::get_snapshot() {
+    if (flushed && (!snapshot || snapshot->draw_tick != flushed->draw_tick)) {
+        update_snapshot(*flushed);
+    }
+
+    return snapshot;
+}
+
 void ui_controller::flush() {
+    if (is_multigrid()) {
+        compose();
+    }
+
+    publish_messages();
+
+    if (writing->graphemes.size() > compact_graphemes_size) {
+        compact_graphemes();
+    }
+
     grid *completed = writing;
+    completed->update_row_hashes();
     completed->draw_tick += 1;
+    publish_redraw_stats();
     
+    flushed = completed;
     writing = complete.exchange(completed);
-    *writing = *completed;
+    writing->sync(*completed);
+
+    if (grid_resized) {
+        resized_flushes += 1;
+        flushed_size = completed->size();
+        grid_resized = false;
+    }
 
     if (signal_flush) {
         dispatch_semaphore_signal(signal_flush);
@@ -408,37 +1462,125 @@ void ui_controller::flush() {
     }
 }
 
-static inline void adjust_defaults(const cell_attributes &def,
-                                   cell_attributes &attrs) {
-    bool reversed = attrs.flags & cell_attributes::reverse;
-    
-    if (attrs.foreground.is_default()) {
-        attrs.foreground = reversed ? def.background : def.foreground;
+void ui_controller::grid_destroy(size_t grid_id) {
+    if (layers.erase(grid_id)) {
+        layout_changed = true;
     }
-    
-    if (attrs.background.is_default()) {
-        attrs.background = reversed ? def.foreground : def.background;
+}
+
+void ui_controller::win_pos(size_t grid_id, msg::object,
+                            long start_row, long start_col,
+                            size_t, size_t) {
+    grid_layer *layer = get_layer(grid_id);
+
+    if (!layer) {
+        return;
     }
-    
-    if (attrs.special.is_default()) {
-        attrs.special = def.special;
+
+    layer->row = start_row;
+    layer->col = start_col;
+    layer->zindex = window_zindex;
+    layer->visible = true;
+    layout_changed = true;
+}
+
+static inline std::optional<double> to_double(const msg::object &object) {
+    if (object.is<msg::float64>()) {
+        return object.get<msg::float64>();
     }
+
+    if (object.is<msg::integer>()) {
+        return object.get<msg::integer>().as<int64_t>();
+    }
+
+    return std::nullopt;
+}
+
+void ui_controller::win_float_pos(size_t grid_id, msg::object,
+                                  msg::string anchor, size_t anchor_grid,
+                                  msg::object anchor_row,
+                                  msg::object anchor_col, bool) {
+    grid_layer *layer = get_layer(grid_id);
+    grid_layer *anchor_layer = get_layer(anchor_grid);
+
+    if (!layer || !anchor_layer) {
+        return;
+    }
+
+    auto row = to_double(anchor_row);
+    auto col = to_double(anchor_col);
+
+    if (!row || !col || anchor.size() != 2) {
+        return os_log_error(rpc, "Redraw error: Invalid float position - "
+                                 "Event=win_float_pos, Anchor=%.*s",
+                                 (int)anchor.size(), anchor.data());
+    }
+
+    // The anchor names the corner of the float placed at the anchor position.
+    long float_row = std::floor(*row);
+    long float_col = std::floor(*col);
+
+    if (anchor[0] == 'S') {
+        float_row -= layer->content.height();
+    }
+
+    if (anchor[1] == 'E') {
+        float_col -= layer->content.width();
+    }
+
+    layer->row = anchor_layer->row + float_row;
+    layer->col = anchor_layer->col + float_col;
+    layer->zindex = float_zindex;
+    layer->visible = true;
+    layout_changed = true;
+}
+
+void ui_controller::win_hide(size_t grid_id) {
+    if (grid_layer *layer = get_layer(grid_id)) {
+        layer->visible = false;
+        layout_changed = true;
+    }
+}
+
+void ui_controller::win_close(size_t grid_id) {
+    win_hide(grid_id);
+}
+
+void ui_controller::msg_set_pos(size_t grid_id, size_t row, bool,
+                                msg::string) {
+    grid_layer *layer = get_layer(grid_id);
+
+    if (!layer) {
+        return;
+    }
+
+    layer->row = row;
+    layer->col = 0;
+    layer->zindex = message_zindex;
+    layer->visible = true;
+    layout_changed = true;
 }
 
 void ui_controller::default_colors_set(uint32_t fg, uint32_t bg, uint32_t sp) {
-    cell_attributes &def = hl_table[0];
+    cell_attributes def = {};
     def.foreground = rgb_color(fg, rgb_color::default_tag);
     def.background = rgb_color(bg, rgb_color::default_tag);
     def.special = rgb_color(sp, rgb_color::default_tag);
-    def.flags = 0;
-    
-    for (cell_attributes &attrs : hl_table) {
-        adjust_defaults(def, attrs);
-    }
-    
-    for (cell &cell : writing->cells) {
-        adjust_defaults(def, cell.attrs);
+
+    // Neovim sends default_colors_set redundantly, e.g. on every :highlight.
+    cell_attributes &current = writing->hl_table[0];
+
+    if (current.foreground.is_default() &&
+        current.foreground.rgb() == def.foreground.rgb() &&
+        current.background.rgb() == def.background.rgb() &&
+        current.special.rgb() == def.special.rgb()) {
+        return;
     }
+
+    // Default colors are resolved when cells are read, so this is all we need
+    // to do. Neither the cells nor the other highlight groups are modified.
+    current = def;
+    writing->highlight_tick = writing->next_tick();
 }
 
 static inline void set_rgb_color(rgb_color &color, const msg::object &object) {
@@ -453,7 +1595,7 @@ static inline void set_rgb_color(rgb_color &color, const msg::object &object) {
 }
 
 void ui_controller::hl_attr_define(size_t hlid, msg::map definition) {
-    cell_attributes *attrs = hl_new_entry(hl_table, hlid);
+    cell_attributes *attrs = hl_new_entry(writing->hl_table, hlid);
     
     for (const auto& [key, value] : definition) {
         if (!key.is<msg::string>()) {
@@ -494,6 +1636,8 @@ void ui_controller::hl_attr_define(size_t hlid, msg::map definition) {
     if (attrs->flags & cell_attributes::reverse) {
         std::swap(attrs->background, attrs->foreground);
     }
+
+    writing->highlight_tick = writing->next_tick();
 }
 
 static inline cursor_shape to_cursor_shape(msg::string name) {
@@ -515,15 +1659,16 @@ static inline cursor_shape to_cursor_shape(msg::string name) {
 static inline void set_color_attrs(cursor_attributes *cursor_attrs,
                                    const highlight_table &hl_table,
                                    size_t hlid) {
-    const cell_attributes *hl_attrs = hl_get_entry(hl_table, hlid);
-    cursor_attrs->special = hl_attrs->special;
+    cell_attributes hl_attrs = *hl_get_entry(hl_table, hlid);
+    resolve_default_colors(hl_table[0], hl_attrs);
+    cursor_attrs->special = hl_attrs.special;
     
     if (hlid != 0) {
-        cursor_attrs->foreground = hl_attrs->foreground;
-        cursor_attrs->background = hl_attrs->background;
+        cursor_attrs->foreground = hl_attrs.foreground;
+        cursor_attrs->background = hl_attrs.background;
     } else {
-        cursor_attrs->foreground = hl_attrs->background;
-        cursor_attrs->background = hl_attrs->foreground;
+        cursor_attrs->foreground = hl_attrs.background;
+        cursor_attrs->background = hl_attrs.foreground;
     }
 }
 
@@ -596,10 +1741,12 @@ void ui_controller::mode_info_set(bool enabled, msg::array property_maps) {
                               msg::type_string(object).c_str());
         } else {
             msg::map map = object.get<msg::map>();
-            cursor_attributes attrs = to_cursor_attributes(hl_table, map);
+            cursor_attributes attrs = to_cursor_attributes(writing->hl_table,
+                                                           map);
 
             if (attrs.shortname == current_mode_name) {
                 writing->cursor_attrs = attrs;
+                writing->cursor_tick = writing->next_tick();
             }
 
             mode_table.push_back(attrs);
@@ -615,51 +1762,319 @@ void ui_controller::mode_change(msg::string name, size_t index) {
     }
 
     writing->cursor_attrs = mode_table[index];
+    writing->cursor_tick = writing->next_tick();
 }
 
 void ui_controller::set_title(msg::string new_title) {
-    {
-        std::lock_guard lock(option_lock);
-        option_title = new_title;
-    }
+    option_values.title = new_title;
+    publish_options();
 
     if (send_option_change()) {
         window.title_set();
     }
 }
 
-std::string ui_controller::get_title() {
-    std::lock_guard lock(option_lock);
-    return option_title;
+void ui_controller::hl_group_set(msg::string name, size_t hlid) {
+    popupmenu &pum = writing->pum;
+    uint16_t *group = nullptr;
+
+    if (name == "Pmenu") {
+        group = &pum.hl_normal;
+    } else if (name == "PmenuSel") {
+        group = &pum.hl_selected;
+    } else if (name == "PmenuSbar") {
+        group = &pum.hl_scrollbar;
+    } else if (name == "PmenuThumb") {
+        group = &pum.hl_thumb;
+    }
+
+    if (group && *group != hlid) {
+        *group = hlid;
+        writing->popupmenu_tick = writing->next_tick();
+    }
 }
 
-std::string ui_controller::get_guifont() {
-    std::lock_guard lock(option_lock);
-    return option_guifont;
+void ui_controller::popupmenu_show(msg::array items, long selected,
+                                   long row, long col, long grid) {
+    auto item_list = std::make_shared<std::vector<popupmenu_item>>();
+    item_list->reserve(items.size());
+
+    for (const msg::object &object : items) {
+        const msg::array *item = object.get_if<msg::array>();
+
+        if (!item || item->size() < 4 ||
+            !std::all_of(item->begin(), item->begin() + 4,
+                         [](const msg::object &field) {
+                return field.is<msg::string>();
+            })) {
+            os_log_error(rpc, "Redraw error: Item type error - "
+                              "Event=popupmenu_show, Type=%s",
+                              msg::type_string(object).c_str());
+            continue;
+        }
+
+        item_list->push_back(popupmenu_item{
+            std::string(item->at(0).get<msg::string>()),
+            std::string(item->at(1).get<msg::string>()),
+            std::string(item->at(2).get<msg::string>()),
+            std::string(item->at(3).get<msg::string>())
+        });
+    }
+
+    popupmenu &pum = writing->pum;
+    pum.item_list = std::move(item_list);
+    pum.selected_index = selected;
+    pum.anchor_row = row;
+    pum.anchor_col = col;
+    pum.anchor_grid = grid;
+    pum.is_visible = true;
+    writing->popupmenu_tick = writing->next_tick();
 }
 
-nvim::options ui_controller::get_options() {
-    std::lock_guard lock(option_lock);
-    return opts;
+void ui_controller::popupmenu_select(long selected) {
+    writing->pum.selected_index = selected;
+    writing->popupmenu_tick = writing->next_tick();
 }
 
-static inline void set_font_option(std::string &opt_guifont,
-                                   const msg::object &value,
-                                   window_controller &window,
-                                   bool send_option_change) {
-    if (!value.is<msg::string>()) {
-        return os_log_info(rpc, "Redraw info: Option type error - "
-                                "Option=guifont Type=%s",
-                                msg::type_string(value).c_str());
+void ui_controller::popupmenu_hide() {
+    popupmenu &pum = writing->pum;
+    pum.item_list = nullptr;
+    pum.is_visible = false;
+    writing->popupmenu_tick = writing->next_tick();
+}
+
+/// Converts an array of [attr_id, text] chunks to styled_text.
+static styled_text to_styled_text(const msg::array &chunks, const char *event) {
+    styled_text text;
+    text.reserve(chunks.size());
+
+    for (const msg::object &object : chunks) {
+        const msg::array *chunk = object.get_if<msg::array>();
+
+        if (!chunk || chunk->size() < 2 || !chunk->at(1).is<msg::string>()) {
+            os_log_error(rpc, "Redraw error: Chunk type error - "
+                              "Event=%s, Type=%s",
+                              event, msg::type_string(object).c_str());
+            continue;
+        }
+
+        // Older versions of Neovim send attribute maps rather than IDs. The
+        // default highlight is used for those chunks.
+        uint16_t hlid = 0;
+
+        if (chunk->at(0).is<msg::integer>()) {
+            hlid = chunk->at(0).get<msg::integer>().as<uint16_t>();
+        }
+
+        text.push_back(text_chunk{
+            std::string(chunk->at(1).get<msg::string>()), hlid
+        });
     }
 
-    opt_guifont = value.get<msg::string>();
+    return text;
+}
+
+void ui_controller::cmdline_show(msg::array content, size_t pos,
+                                 msg::string firstc, msg::string prompt,
+                                 size_t indent, size_t level) {
+    cmdline &cmd = writing->cmd;
+    cmd.text = to_styled_text(content, "cmdline_show");
+    cmd.cursor_pos = pos;
+    cmd.first_char = firstc;
+    cmd.prompt_text = prompt;
+    cmd.indent_width = indent;
+    cmd.cmdline_level = level;
+    cmd.special.clear();
+    cmd.shift = false;
+    cmd.is_visible = true;
+    writing->cmdline_tick = writing->next_tick();
+
+    // Entering the command line dismisses the message history.
+    msg_history_clear();
+}
 
-    if (send_option_change) {
-        window.font_set();
+void ui_controller::cmdline_pos(size_t pos, size_t level) {
+    cmdline &cmd = writing->cmd;
+
+    if (level == cmd.cmdline_level) {
+        cmd.cursor_pos = pos;
+        cmd.special.clear();
+        writing->cmdline_tick = writing->next_tick();
+    }
+}
+
+void ui_controller::cmdline_special_char(msg::string c, bool shift,
+                                         size_t level) {
+    cmdline &cmd = writing->cmd;
+
+    if (level == cmd.cmdline_level) {
+        cmd.special = c;
+        cmd.shift = shift;
+        writing->cmdline_tick = writing->next_tick();
+    }
+}
+
+void ui_controller::cmdline_hide(size_t level) {
+    cmdline &cmd = writing->cmd;
+
+    if (level == cmd.cmdline_level) {
+        cmd.is_visible = false;
+        cmd.text.clear();
+        cmd.special.clear();
+        writing->cmdline_tick = writing->next_tick();
     }
 }
 
+void ui_controller::cmdline_block_show(msg::array lines) {
+    auto block = std::make_shared<std::vector<styled_text>>();
+    block->reserve(lines.size());
+
+    for (const msg::object &line : lines) {
+        if (line.is<msg::array>()) {
+            block->push_back(to_styled_text(line.get<msg::array>(),
+                                            "cmdline_block_show"));
+        }
+    }
+
+    writing->cmd.block_lines = std::move(block);
+    writing->cmdline_tick = writing->next_tick();
+}
+
+void ui_controller::cmdline_block_append(msg::array line) {
+    cmdline &cmd = writing->cmd;
+    auto block = std::make_shared<std::vector<styled_text>>();
+
+    if (cmd.block_lines) {
+        *block = *cmd.block_lines;
+    }
+
+    block->push_back(to_styled_text(line, "cmdline_block_append"));
+    cmd.block_lines = std::move(block);
+    writing->cmdline_tick = writing->next_tick();
+}
+
+void ui_controller::cmdline_block_hide() {
+    writing->cmd.block_lines = nullptr;
+    writing->cmdline_tick = writing->next_tick();
+}
+
+void ui_controller::msg_show(msg::string kind, msg::array content,
+                             bool replace_last) {
+    if (replace_last && !shown_messages.empty()) {
+        shown_messages.pop_back();
+    }
+
+    shown_messages.push_back(message{
+        std::string(kind), to_styled_text(content, "msg_show")
+    });
+
+    shown_changed = true;
+}
+
+void ui_controller::msg_clear() {
+    if (!shown_messages.empty()) {
+        shown_messages.clear();
+        shown_changed = true;
+    }
+
+    // Neovim 0.4 never sends msg_history_clear. The history is displayed
+    // like a message, until the message area is next cleared.
+    msg_history_clear();
+}
+
+void ui_controller::msg_showmode(msg::array content) {
+    writing->msgs.mode_text = to_styled_text(content, "msg_showmode");
+    writing->messages_tick = writing->next_tick();
+}
+
+void ui_controller::msg_showcmd(msg::array content) {
+    writing->msgs.command_text = to_styled_text(content, "msg_showcmd");
+    writing->messages_tick = writing->next_tick();
+}
+
+void ui_controller::msg_ruler(msg::array content) {
+    writing->msgs.ruler_text = to_styled_text(content, "msg_ruler");
+    writing->messages_tick = writing->next_tick();
+}
+
+void ui_controller::msg_history_show(msg::array entries) {
+    message_history.clear();
+    message_history.reserve(entries.size());
+
+    for (const msg::object &object : entries) {
+        const msg::array *entry = object.get_if<msg::array>();
+
+        if (!entry || entry->size() < 2 || !entry->at(0).is<msg::string>() ||
+            !entry->at(1).is<msg::array>()) {
+            os_log_error(rpc, "Redraw error: Entry type error - "
+                              "Event=msg_history_show, Type=%s",
+                              msg::type_string(object).c_str());
+            continue;
+        }
+
+        message_history.push_back(message{
+            std::string(entry->at(0).get<msg::string>()),
+            to_styled_text(entry->at(1).get<msg::array>(), "msg_history_show")
+        });
+    }
+
+    history_changed = true;
+}
+
+void ui_controller::msg_history_clear() {
+    if (!message_history.empty()) {
+        message_history.clear();
+        history_changed = true;
+    }
+}
+
+void ui_controller::publish_messages() {
+    if (shown_changed) {
+        writing->msgs.shown_list =
+            std::make_shared<std::vector<message>>(shown_messages);
+        writing->messages_tick = writing->next_tick();
+        shown_changed = false;
+    }
+
+    if (history_changed) {
+        writing->msgs.history_list =
+            std::make_shared<std::vector<message>>(message_history);
+        writing->messages_tick = writing->next_tick();
+        history_changed = false;
+    }
+}
+
+void ui_controller::publish_options() {
+    auto next = std::make_unique<const option_state>(option_values);
+    published_options.store(next.get());
+
+    if (owned_options) {
+        retired_options.push_back(std::move(owned_options));
+    }
+
+    owned_options = std::move(next);
+
+    // Readers register themselves before loading the published state. If no
+    // readers are registered after the store, any new readers will load the
+    // new state, so retired states are safe to delete.
+    if (option_readers.load() == 0) {
+        retired_options.clear();
+    }
+}
+
+static inline bool set_font_option(std::string &opt_guifont,
+                                   const msg::object &value) {
+    if (!value.is<msg::string>()) {
+        os_log_info(rpc, "Redraw info: Option type error - "
+                         "Option=guifont Type=%s",
+                         msg::type_string(value).c_str());
+        return false;
+    }
+
+    opt_guifont = value.get<msg::string>();
+    return true;
+}
+
 static inline void set_ext_option(bool &opt, const msg::object &value) {
     if (!value.is<msg::boolean>()) {
         return os_log_info(rpc, "Redraw info: Option type error - "
@@ -671,24 +2086,31 @@ static inline void set_ext_option(bool &opt, const msg::object &value) {
 }
 
 void ui_controller::set_option(msg::string name, msg::object value) {
-    if (name == "guifont") {
-        set_font_option(option_guifont, value, window, send_option_change());
-    } else if (name == "ext_cmdline")  {
-        set_ext_option(opts.ext_cmdline, value);
-    } else if (name == "ext_hlstate")  {
-        set_ext_option(opts.ext_hlstate, value);
-    } else if (name == "ext_linegrid")  {
-        set_ext_option(opts.ext_linegrid, value);
-    } else if (name == "ext_messages")  {
-        set_ext_option(opts.ext_messages, value);
-    } else if (name == "ext_multigrid")  {
-        set_ext_option(opts.ext_multigrid, value);
-    } else if (name == "ext_popupmenu")  {
-        set_ext_option(opts.ext_popupmenu, value);
-    } else if (name == "ext_tabline")  {
-        set_ext_option(opts.ext_tabline, value);
-    } else if (name == "ext_termcolors")  {
-        set_ext_option(opts.ext_termcolors, value);
+    options &opts = option_values.opts;
+
+    switch (option_table.find(name)) {
+    case option_name::guifont:
+        font_option_set |= set_font_option(option_values.guifont, value);
+        return;
+    case option_name::ext_cmdline:
+        return set_ext_option(opts.ext_cmdline, value);
+    case option_name::ext_hlstate:
+        return set_ext_option(opts.ext_hlstate, value);
+    case option_name::ext_linegrid:
+        return set_ext_option(opts.ext_linegrid, value);
+    case option_name::ext_messages:
+        return set_ext_option(opts.ext_messages, value);
+    case option_name::ext_multigrid:
+        layout_changed = true;
+        return set_ext_option(opts.ext_multigrid, value);
+    case option_name::ext_popupmenu:
+        return set_ext_option(opts.ext_popupmenu, value);
+    case option_name::ext_tabline:
+        return set_ext_option(opts.ext_tabline, value);
+    case option_name::ext_termcolors:
+        return set_ext_option(opts.ext_termcolors, value);
+    case option_name::unknown:
+        return;
     }
 }
 
@@ -11,7 +11,12 @@
 #define UI_HPP
 
 #include <dispatch/dispatch.h>
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include "msgpack.hpp"
 #include "unfair_lock.hpp"
 
@@ -121,6 +126,28 @@ struct cell_attributes {
     uint16_t flags;
 };
 
+/// Replaces the default tagged colors in attrs with the default colors.
+/// Highlight groups keep default tagged colors, so a change of default colors
+/// only has to update the default highlight group.
+/// @param def      The default highlight group. Its colors are default tagged.
+/// @param attrs    The attributes to resolve.
+inline void resolve_default_colors(const cell_attributes &def,
+                                   cell_attributes &attrs) {
+    bool reversed = attrs.flags & cell_attributes::reverse;
+
+    if (attrs.foreground.is_default()) {
+        attrs.foreground = reversed ? def.background : def.foreground;
+    }
+
+    if (attrs.background.is_default()) {
+        attrs.background = reversed ? def.foreground : def.background;
+    }
+
+    if (attrs.special.is_default()) {
+        attrs.special = def.special;
+    }
+}
+
 /// Cell attributes that affect font rendering.
 enum class font_attributes {
     none,
@@ -143,6 +170,8 @@ private:
     cell_attributes attrs;
 
     friend class ui_controller;
+    friend class grid;
+    friend class packed_cell;
 
 public:
     /// Zero initialized cell.
@@ -248,6 +277,87 @@ public:
     }
 };
 
+/// A grid cell, as stored in a grid.
+///
+/// Packed cells are a compact encoding of cells. Short graphemes, which
+/// includes all of ASCII, are stored inline. Longer graphemes are interned in
+/// the grid's grapheme table. Rather than holding a copy of their attributes,
+/// packed cells refer to an entry in the grid's highlight table. Use
+/// grid::get() to obtain a cell with the grapheme and attributes resolved.
+class packed_cell {
+private:
+    static constexpr size_t inline_capacity = 8;
+
+    enum flag : uint8_t {
+        doublewidth = 1 << 0
+    };
+
+    // Holds the grapheme if size <= inline_capacity, otherwise holds the
+    // grapheme's index in the grid's grapheme table.
+    char text[inline_capacity];
+    uint16_t hlid;
+    uint8_t size;
+    uint8_t flags;
+
+    friend class grid;
+    friend class grid_snapshot;
+    friend class ui_controller;
+
+    bool is_interned() const {
+        return size > inline_capacity;
+    }
+
+    uint32_t intern_index() const {
+        uint32_t index;
+        memcpy(&index, text, sizeof(index));
+        return index;
+    }
+
+    /// Returns a cell with the grapheme and attributes resolved.
+    nvim::cell unpack(const std::vector<cell_attributes> &hl_table,
+                      const std::vector<grapheme_cluster> &graphemes) const {
+        nvim::cell cell;
+        cell.size = size;
+
+        if (is_interned()) {
+            cell.text = graphemes[intern_index()];
+        } else {
+            memcpy(cell.text.data(), text, size);
+        }
+
+        size_t index = hlid < hl_table.size() ? hlid : 0;
+        cell.attrs = hl_table[index];
+        resolve_default_colors(hl_table[0], cell.attrs);
+
+        if (flags & doublewidth) {
+            cell.attrs.flags |= cell_attributes::doublewidth;
+        }
+
+        return cell;
+    }
+
+public:
+    /// Zero initialized cell. Empty, with the default highlight attributes.
+    packed_cell(): text{}, hlid(0), size(0), flags(0) {}
+
+    /// True if the cell is empty, false otherwise.
+    bool empty() const {
+        return size == 0;
+    }
+
+    /// The cell's highlight ID.
+    uint16_t hl_id() const {
+        return hlid;
+    }
+
+    /// Returns 1 for single width characters, 2 for full width characters.
+    uint32_t width() const {
+        return (bool)(flags & doublewidth) + 1;
+    }
+};
+
+static_assert(sizeof(packed_cell) == 12);
+
 struct grid_size {
     int32_t width;
     int32_t height;
@@ -284,48 +394,60 @@ private:
     cursor_attributes attrs_;
     size_t row_;
     size_t col_;
-    const cell *ptr_;
+    nvim::cell cell_;
 
 public:
     /// A default constructed cursor should only be assigned to or destroyed.
     /// This constructor is only provided because Objective-C++ requires C++
     /// instance variables to be default constructible.
-    cursor(): attrs_(), row_(0), col_(0), ptr_(nullptr) {}
+    cursor(): attrs_(), row_(0), col_(0), cell_() {}
 
     /// Construct a new cursor object.
     /// @param row      The row position of the cursor.
     /// @param col      The column position of the cursor.
-    /// @param ptr      A pointer to the cursor's underlying cell.
+    /// @param cell     The cursor's underlying cell.
     /// @param attrs    The cursor's attributes.
-    cursor(size_t row, size_t col, const cell *ptr, cursor_attributes attrs):
-        attrs_(attrs), row_(row), col_(col), ptr_(ptr) {
+    cursor(size_t row, size_t col,
+           const nvim::cell &cell, cursor_attributes attrs):
+        attrs_(attrs), row_(row), col_(col), cell_(cell) {
         if (attrs_.special.is_default()) {
-            attrs_.special = ptr->special();
+            attrs_.special = cell.special();
         }
 
         if (attrs_.background.is_default()) {
             if (attrs_.foreground.is_default()) {
-                attrs_.background = ptr->foreground();
-                attrs_.foreground = ptr->background();
+                attrs_.background = cell.foreground();
+                attrs_.foreground = cell.background();
                 return;
             }
 
-            attrs_.background = ptr->background();
+            attrs_.background = cell.background();
         }
 
         if (attrs_.foreground.is_default()) {
-            attrs_.foreground = ptr->foreground();
+            attrs_.foreground = cell.foreground();
         }
     }
 
-    /// A reference to the underlying cell.
+    /// Returns a copy of the cursor moved to the given position and cell.
+    /// The cursor's colors are not updated to match the new cell. Used to draw
+    /// the cursor in UI elements drawn over the grid, e.g. the command line.
+    nvim::cursor moved(size_t row, size_t col, const nvim::cell &cell) const {
+        nvim::cursor moved_cursor = *this;
+        moved_cursor.row_ = row;
+        moved_cursor.col_ = col;
+        moved_cursor.cell_ = cell;
+        return moved_cursor;
+    }
+
+    /// The underlying cell.
     const nvim::cell& cell() const {
-        return *ptr_;
+        return cell_;
     }
 
     /// The width of the underlying cell.
     uint32_t width() const {
-        return ptr_->width();
+        return cell_.width();
     }
 
     /// Get the cursor shape.
@@ -401,13 +523,308 @@ public:
     }
 };
 
+/// A grid_scroll operation. See nvim :help ui-event-grid_scroll.
+struct grid_scroll_region {
+    uint64_t tick;
+    size_t top;
+    size_t bottom;
+    size_t left;
+    size_t right;
+    long rows;
+};
+
+/// Describes how a grid has changed since an earlier draw tick.
+///
+/// To bring a copy of the grid at the earlier draw tick up to date, apply the
+/// scrolls in order, then redraw the changed rows. If full is true, the copy
+/// can't be brought up to date incrementally, and every row is listed as
+/// changed.
+struct grid_changes {
+    std::vector<grid_scroll_region> scrolls;
+    std::vector<size_t> rows;
+    bool full;
+    bool cursor;
+    bool popupmenu;
+    bool cmdline;
+    bool messages;
+
+    // If highlights changed, the appearance of any cell may have changed.
+    bool highlights;
+
+    /// True if nothing has changed.
+    bool empty() const {
+        return !full && !cursor && !popupmenu && !cmdline && !messages &&
+               !highlights &&
+               scrolls.empty() && rows.empty();
+    }
+};
+
+/// A window grid's position in a composited grid. See nvim :help ui-multigrid.
+struct grid_window {
+    size_t grid;
+    long row;
+    long col;
+    size_t width;
+    size_t height;
+};
+
+/// A position in a Neovim grid.
+struct grid_location {
+    size_t grid;
+    size_t row;
+    size_t col;
+};
+
+/// A popup menu item. See nvim :help ui-popupmenu.
+struct popupmenu_item {
+    std::string word;
+    std::string kind;
+    std::string menu;
+    std::string info;
+};
+
+/// The completion popup menu.
+///
+/// With ext_popupmenu, Neovim sends the popup menu's items and selection
+/// rather than drawing the menu into a grid. Items are immutable and shared
+/// between copies, so copying a popup menu doesn't copy its items.
+class popupmenu {
+private:
+    std::shared_ptr<const std::vector<popupmenu_item>> item_list;
+    long selected_index;
+    long anchor_row;
+    long anchor_col;
+    long anchor_grid;
+    bool is_visible;
+
+    // The highlight IDs of the Pmenu, PmenuSel, PmenuSbar, and PmenuThumb
+    // highlight groups. Set by hl_group_set events.
+    uint16_t hl_normal;
+    uint16_t hl_selected;
+    uint16_t hl_scrollbar;
+    uint16_t hl_thumb;
+
+    friend class ui_controller;
+
+public:
+    popupmenu(): selected_index(-1), anchor_row(0), anchor_col(0),
+                 anchor_grid(0), is_visible(false), hl_normal(0),
+                 hl_selected(0), hl_scrollbar(0), hl_thumb(0) {}
+
+    /// True if the popup menu is shown.
+    bool visible() const {
+        return is_visible && item_list && !item_list->empty();
+    }
+
+    /// The number of items in the menu.
+    size_t size() const {
+        return item_list ? item_list->size() : 0;
+    }
+
+    /// The item at the given index.
+    const popupmenu_item& operator[](size_t index) const {
+        return (*item_list)[index];
+    }
+
+    /// The index of the selected item, or -1 if no item is selected.
+    long selected() const {
+        return selected_index;
+    }
+
+    /// The anchor row. The menu is drawn below or above this row.
+    long row() const {
+        return anchor_row;
+    }
+
+    /// The anchor column. The first character of each item's word is drawn
+    /// in this column.
+    long col() const {
+        return anchor_col;
+    }
+
+    /// The grid the anchor position refers to, or -1 for the command line.
+    long grid() const {
+        return anchor_grid;
+    }
+
+    /// The highlight ID of unselected items.
+    uint16_t normal_hl_id() const {
+        return hl_normal;
+    }
+
+    /// The highlight ID of the selected item.
+    uint16_t selected_hl_id() const {
+        return hl_selected;
+    }
+
+    /// The highlight ID of the scrollbar.
+    uint16_t scrollbar_hl_id() const {
+        return hl_scrollbar;
+    }
+
+    /// The highlight ID of the scrollbar thumb.
+    uint16_t thumb_hl_id() const {
+        return hl_thumb;
+    }
+};
+
+/// A chunk of text with a highlight ID.
+struct text_chunk {
+    std::string text;
+    uint16_t hlid;
+};
+
+/// Text made up of highlighted chunks.
+using styled_text = std::vector<text_chunk>;
+
+/// The command line. Only used with ext_cmdline. See nvim :help ui-cmdline.
+class cmdline {
+private:
+    styled_text text;
+    std::string first_char;
+    std::string prompt_text;
+    std::string special;
+    size_t cursor_pos;
+    size_t indent_width;
+    size_t cmdline_level;
+    bool shift;
+    bool is_visible;
+
+    // Lines shown above the command line, e.g. when entering a function
+    // definition. Shared between copies.
+    std::shared_ptr<const std::vector<styled_text>> block_lines;
+
+    friend class ui_controller;
+
+public:
+    cmdline(): cursor_pos(0), indent_width(0), cmdline_level(0),
+               shift(false), is_visible(false) {}
+
+    /// True if the command line is shown.
+    bool visible() const {
+        return is_visible;
+    }
+
+    /// The command line's contents, excluding the prompt and indent.
+    const styled_text& content() const {
+        return text;
+    }
+
+    /// The cursor position, as a byte offset into content().
+    size_t pos() const {
+        return cursor_pos;
+    }
+
+    /// The command type, e.g. ":", "/", or "=". Empty for input() prompts.
+    const std::string& firstc() const {
+        return first_char;
+    }
+
+    /// The prompt of an input() call. Empty for other command lines.
+    const std::string& prompt() const {
+        return prompt_text;
+    }
+
+    /// The number of spaces to insert before content().
+    size_t indent() const {
+        return indent_width;
+    }
+
+    /// The nesting level of the command line. Command lines opened from
+    /// another command line, e.g. with <C-r>=, have higher levels.
+    size_t level() const {
+        return cmdline_level;
+    }
+
+    /// A special character shown at the cursor position after keys like
+    /// <C-v>, or empty if there is none.
+    const std::string& special_char() const {
+        return special;
+    }
+
+    /// If true, special_char() is inserted before the cursor position,
+    /// otherwise it's drawn over the character at the cursor position.
+    bool special_shift() const {
+        return shift;
+    }
+
+    /// The number of block lines.
+    size_t block_size() const {
+        return block_lines ? block_lines->size() : 0;
+    }
+
+    /// The block line at the given index.
+    const styled_text& block_line(size_t index) const {
+        return (*block_lines)[index];
+    }
+};
+
+/// A message. See nvim :help ui-messages.
+struct message {
+    std::string kind;
+    styled_text content;
+};
+
+/// Messages, and the mode, command and ruler indicators. Only used with
+/// ext_messages. See nvim :help ui-messages.
+///
+/// Message lists are shared between copies, so copying messages doesn't copy
+/// every message.
+class messages {
+private:
+    std::shared_ptr<const std::vector<message>> shown_list;
+    std::shared_ptr<const std::vector<message>> history_list;
+    styled_text mode_text;
+    styled_text command_text;
+    styled_text ruler_text;
+
+    friend class ui_controller;
+
+    static const std::vector<message>& get(
+            const std::shared_ptr<const std::vector<message>> &list) {
+        static const std::vector<message> empty;
+        return list ? *list : empty;
+    }
+
+public:
+    /// Messages shown since the last msg_clear event, oldest first.
+    const std::vector<message>& shown() const {
+        return get(shown_list);
+    }
+
+    /// The message history requested with :messages, oldest first.
+    /// Only shown until the next msg_clear or cmdline_show event.
+    const std::vector<message>& history() const {
+        return get(history_list);
+    }
+
+    /// The current mode, e.g. "-- INSERT --". See nvim :help 'showmode'.
+    const styled_text& showmode() const {
+        return mode_text;
+    }
+
+    /// The partially entered command. See nvim :help 'showcmd'.
+    const styled_text& showcmd() const {
+        return command_text;
+    }
+
+    /// The ruler. See nvim :help 'ruler'.
+    const styled_text& ruler() const {
+        return ruler_text;
+    }
+};
+
 /// A grid of cells.
 ///
 /// Grid's are conceptually a 2d array of cells. They are created and updated
 /// by a ui_controller in response to redraw events.
 class grid {
 private:
-    std::vector<cell> cells;
+    // Cells are stored in row sized slabs. Rows are mapped to slabs through
+    // row_slabs, which lets full width scrolls rotate slab indexes instead of
+    // copying cells.
+    std::vector<packed_cell> cells;
+    std::vector<uint32_t> row_slabs;
     size_t grid_width;
     size_t grid_height;
     cursor_attributes cursor_attrs;
@@ -415,31 +832,209 @@ private:
     size_t cursor_col;
     uint64_t draw_tick;
 
+    // The draw tick in which each row's contents were last modified. Rows
+    // modified by the redraw events currently being processed have a tick of
+    // draw_tick + 1. Full width scrolls move ticks along with the rows, so
+    // scrolled rows only need to be redrawn if they were also modified.
+    std::vector<uint64_t> row_ticks;
+
+    // A hash of each row's packed cells, as of draw_tick. Hashes of rows
+    // modified since draw_tick are updated on flush. Full width scrolls move
+    // hashes along with the rows.
+    std::vector<uint64_t> row_hashes;
+
+    // The most recent scroll operations. Older operations are overwritten,
+    // the most recently overwritten operation's tick is scroll_dropped_tick.
+    static constexpr size_t scroll_log_size = 16;
+    std::array<grid_scroll_region, scroll_log_size> scroll_log;
+    uint64_t scroll_count;
+    uint64_t scroll_dropped_tick;
+
+    // The draw tick of the most recent change to each of these properties.
+    uint64_t resize_tick;
+    uint64_t cursor_tick;
+    uint64_t highlight_tick;
+    uint64_t popupmenu_tick;
+    uint64_t cmdline_tick;
+    uint64_t messages_tick;
+    uint64_t graphemes_tick;
+
+    // The popup menu, only used with ext_popupmenu. Updated independently of
+    // the grid's cells, so changing the selection doesn't modify any rows.
+    nvim::popupmenu pum;
+
+    // The command line and messages, only used with ext_cmdline and
+    // ext_messages. Like the popup menu, they're updated independently of
+    // the grid's cells.
+    nvim::cmdline cmd;
+    nvim::messages msgs;
+
+    // The highlight table as of this grid's draw tick. Packed cells refer to
+    // their attributes by index. The default attributes are at index 0.
+    std::vector<cell_attributes> hl_table;
+
+    // Graphemes too long to be stored inline in a packed cell. The table is
+    // appended to, so every grid shares the same indexes, until it's
+    // compacted. Compacting replaces the table and rewrites every cell that
+    // refers to it, graphemes_tick is the draw tick of the last compaction.
+    std::vector<grapheme_cluster> graphemes;
+
+    // With ext_multigrid, the window grids composited into this grid, from
+    // bottom to top. Updated when layout_tick changes.
+    std::vector<grid_window> window_list;
+    uint64_t layout_tick;
+
     friend class ui_controller;
 
+    /// A pointer to the packed cell at the given row and column.
+    packed_cell* slot(size_t row, size_t col) {
+        return cells.data() + (row_slabs[row] * grid_width) + col;
+    }
+
+    /// A const pointer to the packed cell at the given row and column.
+    const packed_cell* slot(size_t row, size_t col) const {
+        return cells.data() + (row_slabs[row] * grid_width) + col;
+    }
+
+    /// The tick of the draw currently being written.
+    uint64_t next_tick() const {
+        return draw_tick + 1;
+    }
+
+    /// Marks rows in the range [begin, end) as modified.
+    void set_dirty(size_t begin, size_t end) {
+        std::fill(row_ticks.begin() + begin,
+                  row_ticks.begin() + end, draw_tick + 1);
+    }
+
+    /// Marks row as modified.
+    void set_dirty(size_t row) {
+        row_ticks[row] = draw_tick + 1;
+    }
+
+    /// Marks every row as modified.
+    void set_dirty() {
+        set_dirty(0, row_ticks.size());
+    }
+
+    /// Rehashes the rows modified since draw_tick.
+    void update_row_hashes();
+
+    /// Moves the cells in region, without updating row ticks.
+    void scroll_cells(const grid_scroll_region &region);
+
+    /// Scrolls region, updates row ticks, and records the operation.
+    void scroll(const grid_scroll_region &region);
+
+    /// Resizes the grid, all rows are marked as modified.
+    void resize(size_t width, size_t height);
+
+    /// Brings this grid up to date with a more recent grid.
+    /// Scrolls are replayed, then only rows modified after this grid's draw
+    /// tick are copied.
+    void sync(const grid &src);
+
 public:
-    grid(): grid_width(0), grid_height(0), draw_tick(0) {}
+    grid(): grid_width(0), grid_height(0), draw_tick(0), scroll_log{},
+            scroll_count(0), scroll_dropped_tick(0), resize_tick(0),
+            cursor_tick(0), highlight_tick(0), popupmenu_tick(0),
+            cmdline_tick(0), messages_tick(0), graphemes_tick(0),
+            hl_table(1), layout_tick(0) {}
+
+    /// The grid's draw tick. Incremented by each flush.
+    uint64_t tick() const {
+        return draw_tick;
+    }
+
+    /// Returns the changes made to the grid after the given draw tick.
+    grid_changes changes_since(uint64_t tick) const;
 
-    const cell* begin() const {
-        return cells.data();
+    /// The draw tick of the most recent change to the highlight table.
+    uint64_t highlights_tick() const {
+        return highlight_tick;
     }
 
-    const cell* end() const {
-        return cells.data() + cells.size();
+    /// Returns a hash of the row's contents.
+    /// Rows with equal hashes almost certainly have the same graphemes and
+    /// highlight IDs. Highlight attributes aren't hashed, see
+    /// grid_changes::highlights.
+    uint64_t row_hash(size_t row) const {
+        return row_hashes[row];
     }
 
-    /// A pointer to the cell at the given row and column.
-    cell* get(size_t row, size_t col) {
-        return cells.data() + (row * grid_width) + col;
+    /// The window grids composited into this grid, from bottom to top.
+    /// Empty unless ext_multigrid is enabled.
+    const std::vector<grid_window>& windows() const {
+        return window_list;
     }
 
-    /// A const pointer to the cell at the given row and column position.
-    const cell* get(size_t row, size_t col) const {
-        return cells.data() + (row * grid_width) + col;
+    /// Maps a position in this grid to a position in the topmost window grid
+    /// containing it. Without ext_multigrid, the position is returned as is,
+    /// with a grid of 0.
+    grid_location locate(size_t row, size_t col) const {
+        for (auto iter = window_list.rbegin(); iter != window_list.rend(); ++iter) {
+            long window_row = (long)row - iter->row;
+            long window_col = (long)col - iter->col;
+
+            if (window_row >= 0 && window_row < (long)iter->height &&
+                window_col >= 0 && window_col < (long)iter->width) {
+                return grid_location{iter->grid, (size_t)window_row,
+                                     (size_t)window_col};
+            }
+        }
+
+        return grid_location{0, row, col};
+    }
+
+    /// Returns the cell at the given row and column, with its grapheme and
+    /// attributes resolved.
+    nvim::cell get(size_t row, size_t col) const {
+        return resolve(*slot(row, col));
+    }
+
+    /// Returns a cell with packed's grapheme and attributes resolved.
+    nvim::cell resolve(const packed_cell &packed) const {
+        return packed.unpack(hl_table, graphemes);
+    }
+
+    /// Returns a cell with the given text and highlight attributes.
+    /// Used to draw UI elements, such as the popup menu, over the grid.
+    /// Note: Text should be a single grapheme. Double width cells, with a
+    /// width of 2, should be followed by an empty cell.
+    nvim::cell make_cell(std::string_view text, size_t hlid,
+                         size_t width = 1) const {
+        cell_attributes attrs = *(hlid < hl_table.size() ? &hl_table[hlid] :
+                                                           &hl_table[0]);
+        resolve_default_colors(hl_table[0], attrs);
+
+        if (width == 2) {
+            attrs.flags |= cell_attributes::doublewidth;
+        }
+
+        return nvim::cell(text, &attrs);
+    }
+
+    /// Returns the popup menu. Only used with ext_popupmenu.
+    const nvim::popupmenu& popupmenu() const {
+        return pum;
+    }
+
+    /// Returns the command line. Only used with ext_cmdline.
+    const nvim::cmdline& cmdline() const {
+        return cmd;
+    }
+
+    /// Returns the messages. Only used with ext_messages.
+    const nvim::messages& messages() const {
+        return msgs;
     }
 
     /// Returns the grid's cursor.
     nvim::cursor cursor() const {
+        if (cells.empty()) {
+            return nvim::cursor(0, 0, nvim::cell(), cursor_attrs);
+        }
+
         return nvim::cursor(cursor_row,
                             cursor_col,
                             get(cursor_row, cursor_col),
@@ -467,6 +1062,102 @@ public:
     }
 };
 
+/// An immutable snapshot of a grid.
+///
+/// Unlike the grid returned by ui_controller::get_global_grid(), snapshots are
+/// never modified after they're published. Any number of readers can hold a
+/// snapshot, across frames and on any thread. Rows are reference counted and
+/// shared between successive snapshots, only modified rows are copied.
+class grid_snapshot {
+private:
+    using row = std::vector<packed_cell>;
+
+    std::vector<std::shared_ptr<const row>> rows;
+    std::shared_ptr<const std::vector<cell_attributes>> hl_table;
+    std::shared_ptr<const std::vector<grapheme_cluster>> graphemes;
+    std::vector<grid_window> window_list;
+    std::vector<uint64_t> row_hashes;
+    nvim::popupmenu pum;
+    nvim::cmdline cmd;
+    nvim::messages msgs;
+    size_t grid_width;
+    size_t grid_height;
+    cursor_attributes cursor_attrs;
+    size_t cursor_row;
+    size_t cursor_col;
+    uint64_t draw_tick;
+
+    friend class ui_controller;
+
+public:
+    grid_snapshot(): grid_width(0), grid_height(0), cursor_attrs{},
+                     cursor_row(0), cursor_col(0), draw_tick(0) {}
+
+    /// The draw tick of the grid this snapshot was taken from.
+    uint64_t tick() const {
+        return draw_tick;
+    }
+
+    /// The window grids composited into this snapshot, from bottom to top.
+    /// Empty unless ext_multigrid is enabled.
+    const std::vector<grid_window>& windows() const {
+        return window_list;
+    }
+
+    /// Returns the cell at the given row and column, with its grapheme and
+    /// attributes resolved.
+    nvim::cell get(size_t row, size_t col) const {
+        return (*rows[row])[col].unpack(*hl_table, *graphemes);
+    }
+
+    /// Returns a hash of the row's contents. See grid::row_hash().
+    uint64_t row_hash(size_t row) const {
+        return row_hashes[row];
+    }
+
+    /// Returns the popup menu. Only used with ext_popupmenu.
+    const nvim::popupmenu& popupmenu() const {
+        return pum;
+    }
+
+    /// Returns the command line. Only used with ext_cmdline.
+    const nvim::cmdline& cmdline() const {
+        return cmd;
+    }
+
+    /// Returns the messages. Only used with ext_messages.
+    const nvim::messages& messages() const {
+        return msgs;
+    }
+
+    /// Returns the snapshot's cursor.
+    nvim::cursor cursor() const {
+        if (rows.empty() || grid_width == 0) {
+            return nvim::cursor(0, 0, nvim::cell(), cursor_attrs);
+        }
+
+        return nvim::cursor(cursor_row,
+                            cursor_col,
+                            get(cursor_row, cursor_col),
+                            cursor_attrs);
+    }
+
+    /// Returns the snapshot's width.
+    size_t width() const {
+        return grid_width;
+    }
+
+    /// Returns the snapshot's height.
+    size_t height() const {
+        return grid_height;
+    }
+
+    /// Returns The snapshot's size.
+    nvim::grid_size size() const {
+        return nvim::grid_size{(int32_t)grid_width, (int32_t)grid_height};
+    }
+};
+
 /// Neovim UI options. See nvim :help ui-ext-options.
 struct options {
     bool ext_cmdline;
@@ -487,6 +1178,92 @@ inline bool operator!=(const options &left, const options &right) {
     return memcmp(&left, &right, sizeof(options)) != 0;
 }
 
+/// The UI options and window title. Immutable once published by a
+/// ui_controller, see ui_controller::read_options().
+struct option_state {
+    std::string title;
+    std::string guifont;
+    nvim::options opts;
+};
+
+/// Read access to the most recently published option_state.
+///
+/// Readers never block or allocate. The state is kept alive for as long as
+/// the reader exists, so readers should be short lived. Replaced states are
+/// only reclaimed while no readers are active.
+class option_reader {
+private:
+    const option_state *state;
+    std::atomic<uint64_t> &readers;
+
+public:
+    option_reader(const std::atomic<const option_state*> &current,
+                  std::atomic<uint64_t> &readers): readers(readers) {
+        // Registering before loading ensures the state isn't reclaimed. See
+        // ui_controller::publish_options().
+        readers.fetch_add(1);
+        state = current.load();
+    }
+
+    option_reader(const option_reader&) = delete;
+    option_reader& operator=(const option_reader&) = delete;
+
+    ~option_reader() {
+        readers.fetch_sub(1);
+    }
+
+    /// The Neovim window title.
+    std::string_view title() const {
+        return state->title;
+    }
+
+    /// The guifont option string.
+    std::string_view guifont() const {
+        return state->guifont;
+    }
+
+    /// The Neovim UI options.
+    const nvim::options& options() const {
+        return state->opts;
+    }
+};
+
+/// Identifies a type of redraw event. Defined in ui.cpp.
+enum class redraw_name : uint8_t;
+
+/// Counters for one type of redraw event.
+struct redraw_event_stats {
+    std::string_view name;  ///< The event name, "unknown" for unhandled names.
+    uint64_t events;        ///< The number of events received.
+    uint64_t tuples;        ///< The number of argument tuples received.
+    uint64_t cells;         ///< The number of cells written by the events.
+    uint64_t bytes;         ///< The events' encoded size, while tracing.
+    uint64_t nanoseconds;   ///< Time spent handling the events, while tracing.
+};
+
+/// A redraw event that took longer than the slow event threshold to handle.
+struct slow_redraw_event {
+    std::string name;       ///< The event name, as sent by Neovim.
+    uint64_t tuples;
+    uint64_t bytes;
+    uint64_t nanoseconds;
+    uint64_t flushes;       ///< The number of flushes preceding the event.
+    std::string summary;    ///< The event's first argument tuple, truncated.
+};
+
+/// A copy of a ui_controller's redraw event statistics.
+struct redraw_stats {
+    /// Counters for each type of redraw event, including unknown events.
+    std::vector<redraw_event_stats> events;
+
+    /// The most recent slow events, oldest first.
+    std::vector<slow_redraw_event> slow_events;
+
+    uint64_t flushes;
+    bool tracing;
+    uint64_t slow_threshold;    ///< In nanoseconds.
+};
+
 /// The Neovim window controller.
 /// The window controller receives various UI related updates.
 /// Note: This is a intended to be a thin C++ wrapper around NVWindowController,
@@ -528,9 +1305,15 @@ class ui_controller {
 private:
     dispatch_semaphore_t signal_flush;
     dispatch_semaphore_t signal_enter;
-    std::vector<cell_attributes> hl_table;
     std::vector<cursor_attributes> mode_table;
 
+    // Maps interned graphemes to their index in the grid grapheme tables.
+    // Graphemes are never removed when cells stop using them, so the tables
+    // are compacted on flush once they've doubled in size.
+    static constexpr size_t min_compact_graphemes = 4096;
+    std::unordered_map<std::string, uint32_t> grapheme_ids;
+    size_t compact_graphemes_size;
+
     // We use a multi buffering scheme with our grid objects.
     //   * complete - The most recent complete grid.
     //   * writing  - The grid we're currently writing to.
@@ -544,14 +1327,100 @@ private:
     grid *writing;
     grid *drawing;
 
-    unfair_lock option_lock;
-    std::string option_title;
-    std::string option_guifont;
-    options opts;
+    // The number of flushes that contained a grid_resize event, and the size
+    // of the global grid as of the last flush.
+    uint64_t resized_flushes;
+    grid_size flushed_size;
+    bool grid_resized;
+
+    // With ext_multigrid, Neovim grids are drawn to layers, which are
+    // composited into the writing grid on flush. Layers are only accessed by
+    // the thread handling redraw events, so they're not multi buffered.
+    struct grid_layer {
+        nvim::grid content;
+        size_t id;
+        long row;
+        long col;
+        long zindex;
+        uint64_t order;
+        bool visible;
+    };
+
+    std::unordered_map<size_t, grid_layer> layers;
+    std::vector<grid_layer*> layer_order;
+    std::vector<std::pair<long, long>> dirty_spans;
+    uint64_t layer_sequence;
+    size_t cursor_grid;
+    bool layout_changed;
+
+    // The most recently flushed grid, and the most recent snapshot taken of
+    // it. The flushed grid isn't written to until the next flush hands it
+    // back as the writing grid, so snapshots can be taken from it between
+    // flushes. Snapshots are only taken when requested, so flushes don't pay
+    // for them when there are no readers.
+    grid *flushed;
+    std::shared_ptr<const grid_snapshot> snapshot;
+
+    // With ext_messages, messages are accumulated here and published to the
+    // writing grid once per flush, rather than once per message.
+    std::vector<message> shown_messages;
+    std::vector<message> message_history;
+    bool shown_changed;
+    bool history_changed;
+
+    // The UI options and title. The thread handling redraw events updates
+    // option_values, and publishes an immutable copy of it after each change.
+    // Other threads read the published copy with an option_reader. Replaced
+    // copies are retired, and deleted once no readers are active.
+    option_state option_values;
+    std::unique_ptr<const option_state> owned_options;
+    std::atomic<const option_state*> published_options;
+    std::atomic<uint64_t> option_readers;
+    std::vector<std::unique_ptr<const option_state>> retired_options;
+    bool font_option_set;
+
+    // Redraw event statistics. The thread handling redraw events updates
+    // event_stats, and copies it to published_stats under stats_lock on each
+    // flush. Slow events are recorded directly into the slow_events ring.
+    static constexpr size_t max_slow_events = 32;
+    std::vector<redraw_event_stats> event_stats;
+    uint64_t cells_written;
+    uint64_t stats_flushes;
+    unfair_lock stats_lock;
+    std::vector<redraw_event_stats> published_stats;
+    std::array<slow_redraw_event, max_slow_events> slow_events;
+    uint64_t slow_events_recorded;
+    std::atomic<uint64_t> slow_threshold;
+    std::atomic<bool> tracing;
 
     grid* get_grid(size_t index);
 
-    void redraw_event(const msg::object &event);
+    grid_layer* get_layer(size_t index);
+
+    bool is_multigrid() const {
+        return option_values.opts.ext_multigrid;
+    }
+
+    void compose();
+
+    void mark_layer_dirty(const grid_layer &layer);
+
+    void compose_row(long row, long begin, long end);
+
+    void update_snapshot(const grid &src);
+
+    packed_cell make_cell(msg::string text, uint16_t hlid);
+
+    void compact_graphemes();
+
+    void redraw_event(redraw_name type, msg::string name, msg::array args);
+
+    void traced_redraw_event(redraw_name type, msg::string name,
+                             msg::array args, uint64_t threshold);
+
+    void init_redraw_stats();
+
+    void publish_redraw_stats();
 
     void flush();
 
@@ -576,8 +1445,66 @@ private:
 
     void set_title(msg::string title);
 
+    void hl_group_set(msg::string name, size_t hlid);
+
+    void popupmenu_show(msg::array items, long selected,
+                        long row, long col, long grid);
+
+    void popupmenu_select(long selected);
+
+    void popupmenu_hide();
+
+    void cmdline_show(msg::array content, size_t pos, msg::string firstc,
+                      msg::string prompt, size_t indent, size_t level);
+
+    void cmdline_pos(size_t pos, size_t level);
+
+    void cmdline_special_char(msg::string c, bool shift, size_t level);
+
+    void cmdline_hide(size_t level);
+
+    void cmdline_block_show(msg::array lines);
+
+    void cmdline_block_append(msg::array line);
+
+    void cmdline_block_hide();
+
+    void msg_show(msg::string kind, msg::array content, bool replace_last);
+
+    void msg_clear();
+
+    void msg_showmode(msg::array content);
+
+    void msg_showcmd(msg::array content);
+
+    void msg_ruler(msg::array content);
+
+    void msg_history_show(msg::array entries);
+
+    void msg_history_clear();
+
+    void publish_messages();
+
+    void grid_destroy(size_t grid);
+
+    void win_pos(size_t grid, msg::object win, long start_row, long start_col,
+                 size_t width, size_t height);
+
+    void win_float_pos(size_t grid, msg::object win, msg::string anchor,
+                       size_t anchor_grid, msg::object anchor_row,
+                       msg::object anchor_col, bool focusable);
+
+    void win_hide(size_t grid);
+
+    void win_close(size_t grid);
+
+    void msg_set_pos(size_t grid, size_t row, bool scrolled,
+                     msg::string sep_char);
+
     void set_option(msg::string name, msg::object object);
 
+    void publish_options();
+
     bool send_option_change() const {
         return !signal_flush && !signal_enter;
     }
@@ -585,12 +1512,30 @@ private:
 public:
     window_controller window;
 
-    ui_controller(): hl_table(1), option_title("NVIM") {
+    ui_controller(): option_values{"NVIM", "", {}},
+                     published_options(nullptr), option_readers(0),
+                     slow_threshold(0), tracing(false) {
         signal_flush = nullptr;
         signal_enter = nullptr;
+        resized_flushes = 0;
+        compact_graphemes_size = min_compact_graphemes;
+        flushed_size = grid_size{};
+        grid_resized = false;
+        layer_sequence = 0;
+        cursor_grid = 1;
+        layout_changed = false;
+        shown_changed = false;
+        history_changed = false;
+        font_option_set = false;
+        cells_written = 0;
+        stats_flushes = 0;
+        slow_events_recorded = 0;
         complete = &triple_buffered[0];
         writing  = &triple_buffered[1];
         drawing  = &triple_buffered[2];
+        flushed = nullptr;
+        publish_options();
+        init_redraw_stats();
     }
 
     ui_controller(const ui_controller&) = delete;
@@ -611,6 +1556,14 @@ public:
         }
     }
 
+    /// Returns a snapshot of the most recently flushed grid, or null if
+    /// nothing has been drawn yet. The snapshot is taken lazily, rows that
+    /// haven't changed since the previous snapshot are shared with it.
+    /// Unlike grids returned by get_global_grid(), snapshots can be held
+    /// across frames and read on any thread.
+    /// Note: Must be called from the thread handling redraw events.
+    std::shared_ptr<const grid_snapshot> get_snapshot();
+
     /// Signals semaphore on the next flush event.
     /// Precondition: No signals are currently pending.
     /// Note: window.redraw() is not called when a waiter is signaled.
@@ -651,19 +1604,47 @@ public:
         }
     }
 
+    /// Returns the number of flush events that followed a grid_resize event.
+    /// Note: Only safe to call from the thread handling redraw events.
+    uint64_t resize_flushes() const {
+        return resized_flushes;
+    }
+
+    /// Returns the size of the global grid as of the last flush.
+    /// Note: Only safe to call from the thread handling redraw events.
+    grid_size flushed_grid_size() const {
+        return flushed_size;
+    }
+
     /// Returns true if a grid is ready to be drawn, otherwise false.
     bool is_drawable() {
         return complete.load()->draw_tick > 0;
     }
 
     /// Returns the current Neovim options.
-    nvim::options get_options();
+    nvim::options get_options() {
+        return read_options().options();
+    }
+
+    /// Returns read access to the current options and title.
+    /// May be called from any thread, never blocks.
+    option_reader read_options() {
+        return option_reader(published_options, option_readers);
+    }
 
-    /// Returns the Neovim window title.
-    std::string get_title();
+    /// Enables or disables redraw event tracing. While tracing, the encoded
+    /// size and handling time of each redraw event is counted, and events
+    /// that take longer than slow_threshold nanoseconds to handle are logged
+    /// and recorded in redraw_stats::slow_events. May be called from any
+    /// thread.
+    void trace_redraw_events(bool enabled, uint64_t slow_threshold) {
+        this->slow_threshold.store(slow_threshold, std::memory_order_relaxed);
+        tracing.store(enabled, std::memory_order_relaxed);
+    }
 
-    /// Returns the guifont option string.
-    std::string get_guifont();
+    /// Returns a copy of the redraw event statistics as of the most recent
+    /// flush. May be called from any thread.
+    redraw_stats get_redraw_stats();
 
     /// Handle a Neovim RPC redraw notification.
     /// @param events The paramters of the RPC notification.
@@ -0,0 +1,144 @@
+//
+//  Neovim Mac Test
+//  FlatMap.mm
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <XCTest/XCTest.h>
+#include <unordered_map>
+#include "flat_map.hpp"
+
+struct identity_hash {
+    size_t operator()(uint64_t key) const {
+        return key;
+    }
+};
+
+struct equal_to {
+    bool operator()(uint64_t left, uint64_t right) const {
+        return left == right;
+    }
+};
+
+using map = flat_map<uint64_t, uint32_t, identity_hash, equal_to>;
+
+@interface testFlatMap : XCTestCase
+@end
+
+@implementation testFlatMap
+
+- (void)testDefaultConstructor {
+    map m;
+    XCTAssertEqual(m.size(), 0);
+    XCTAssertEqual(m.capacity(), 0);
+    XCTAssertEqual(m.find(0), nullptr);
+}
+
+- (void)testInsertAndFind {
+    map m;
+    m.insert(1, 10);
+    m.insert(2, 20);
+
+    XCTAssertEqual(m.size(), 2);
+    XCTAssertEqual(*m.find(1), 10);
+    XCTAssertEqual(*m.find(2), 20);
+    XCTAssertEqual(m.find(3), nullptr);
+}
+
+- (void)testInsertReplaces {
+    map m;
+    m.insert(1, 10);
+    m.insert(1, 11);
+
+    XCTAssertEqual(m.size(), 1);
+    XCTAssertEqual(*m.find(1), 11);
+}
+
+- (void)testGrowth {
+    map m;
+
+    for (uint64_t i=0; i<10000; ++i) {
+        m.insert_unique(i, static_cast<uint32_t>(i * 2));
+    }
+
+    XCTAssertEqual(m.size(), 10000);
+
+    for (uint64_t i=0; i<10000; ++i) {
+        XCTAssertEqual(*m.find(i), i * 2);
+    }
+
+    XCTAssertEqual(m.find(10000), nullptr);
+}
+
+- (void)testPoorlyDistributedHashes {
+    map m;
+
+    // Keys that only differ in their high bits.
+    for (uint64_t i=0; i<1000; ++i) {
+        m.insert_unique(i << 40, static_cast<uint32_t>(i));
+    }
+
+    for (uint64_t i=0; i<1000; ++i) {
+        XCTAssertEqual(*m.find(i << 40), i);
+    }
+}
+
+- (void)testReserve {
+    map m;
+    m.reserve(1000);
+    size_t capacity = m.capacity();
+
+    for (uint64_t i=0; i<1000; ++i) {
+        m.insert_unique(i, 0);
+    }
+
+    XCTAssertEqual(m.capacity(), capacity);
+}
+
+- (void)testClear {
+    map m;
+    m.insert(1, 10);
+    size_t capacity = m.capacity();
+    m.clear();
+
+    XCTAssertEqual(m.size(), 0);
+    XCTAssertEqual(m.capacity(), capacity);
+    XCTAssertEqual(m.find(1), nullptr);
+}
+
+- (void)testForEach {
+    map m;
+    std::unordered_map<uint64_t, uint32_t> expected;
+
+    for (uint64_t i=0; i<100; ++i) {
+        m.insert(i * 7, static_cast<uint32_t>(i));
+        expected[i * 7] = static_cast<uint32_t>(i);
+    }
+
+    std::unordered_map<uint64_t, uint32_t> visited;
+
+    m.for_each([&](uint64_t key, uint32_t value) {
+        visited[key] = value;
+    });
+
+    XCTAssertTrue(visited == expected);
+}
+
+- (void)testMove {
+    map m;
+    m.insert(1, 10);
+
+    map moved(std::move(m));
+    XCTAssertEqual(*moved.find(1), 10);
+    XCTAssertEqual(m.size(), 0);
+    XCTAssertEqual(m.find(1), nullptr);
+
+    m = std::move(moved);
+    XCTAssertEqual(*m.find(1), 10);
+    XCTAssertEqual(moved.size(), 0);
+}
+
+@end
@@ -0,0 +1,412 @@
+//
+//  Neovim Mac Test
+//  FrameBuilder.mm
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <XCTest/XCTest.h>
+#include <atomic>
+#include <deque>
+#include <random>
+#include <unordered_map>
+#include "frame_builder.hpp"
+
+/// Builds redraw notifications. Objects are views, so their storage is kept
+/// alive by the builder.
+class redraw_builder {
+private:
+    std::deque<std::vector<msg::object>> arrays;
+    std::deque<std::vector<msg::pair>> maps;
+    std::deque<std::string> strings;
+    std::vector<msg::object> events;
+
+public:
+    msg::object string(std::string_view value) {
+        return msg::string(strings.emplace_back(value));
+    }
+
+    msg::object integer(int64_t value) {
+        return msg::integer(value);
+    }
+
+    msg::object array(std::vector<msg::object> values) {
+        auto &back = arrays.emplace_back(std::move(values));
+        return msg::array(back.data(), back.size());
+    }
+
+    msg::object map(std::vector<msg::pair> values) {
+        auto &back = maps.emplace_back(std::move(values));
+        return msg::map(back.data(), back.size());
+    }
+
+    void event(std::string_view name, std::vector<msg::object> args) {
+        events.push_back(array({string(name), array(std::move(args))}));
+    }
+
+    /// Sends the events, followed by a flush, to ui.
+    void flush(nvim::ui_controller &ui) {
+        event("flush", {});
+
+        // Signaling a semaphore stops the controller calling its window.
+        dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+        ui.signal_on_flush(semaphore);
+        ui.redraw(array(std::move(events)).get<msg::array>());
+        events.clear();
+    }
+};
+
+struct test_frame {
+    uniform_data uniforms;
+    std::vector<background_data> backgrounds;
+    std::vector<glyph_data> glyphs;
+    std::vector<line_data> lines;
+    frame_counts counts;
+};
+
+/// A glyph cache, filled by lookups. Glyphs are keyed by their grapheme and
+/// colors.
+static std::unordered_map<std::string, glyph_rect> glyph_cache;
+static std::atomic<size_t> finds;
+static size_t lookups;
+
+static std::string glyph_key(const nvim::cell &cell) {
+    std::string key(cell.grapheme_view());
+    key += std::to_string(cell.foreground() & 0xFFFFFF);
+    key += std::to_string(cell.background() & 0xFFFFFF);
+    return key;
+}
+
+static const glyph_rect* test_find(const nvim::cell &cell) {
+    finds += 1;
+    auto iter = glyph_cache.find(glyph_key(cell));
+    return iter != glyph_cache.end() ? &iter->second : nullptr;
+}
+
+static glyph_rect test_lookup(const nvim::cell &cell) {
+    std::string_view grapheme = cell.grapheme_view();
+    lookups += 1;
+
+    glyph_rect rect = {};
+    rect.size = simd_make_short2(grapheme.size(), cell.foreground() & 0xFF);
+    char first = grapheme.empty() ? 0 : grapheme[0];
+    rect.position = simd_make_short2(first, cell.background() & 0xFF);
+
+    glyph_cache.emplace(glyph_key(cell), rect);
+    return rect;
+}
+
+static test_frame build_frame(frame_builder &builder, uint64_t generation = 0) {
+    frame_metrics metrics = {};
+    metrics.cell_size = simd_make_float2(8, 16);
+    metrics.undercurl.period = 2;
+
+    finds = 0;
+    lookups = 0;
+
+    test_frame frame;
+    frame.counts = builder.build(builder.cursor(), simd_make_float2(800, 600),
+                                 metrics, generation, test_find, test_lookup);
+
+    frame.backgrounds.resize(frame.counts.backgrounds);
+    frame.glyphs.resize(frame.counts.glyphs);
+    frame.lines.resize(frame.counts.lines);
+
+    frame_buffers buffers;
+    buffers.uniforms = &frame.uniforms;
+    buffers.backgrounds = frame.backgrounds.data();
+    buffers.glyphs = frame.glyphs.data();
+    buffers.lines = frame.lines.data();
+    builder.write(buffers);
+    return frame;
+}
+
+static bool same_frame(const test_frame &left, const test_frame &right) {
+    if (left.counts.backgrounds != right.counts.backgrounds ||
+        left.counts.glyphs != right.counts.glyphs ||
+        left.counts.lines != right.counts.lines) {
+        return false;
+    }
+
+    for (size_t i=0; i<left.counts.backgrounds; ++i) {
+        const background_data &l = left.backgrounds[i];
+        const background_data &r = right.backgrounds[i];
+
+        if (l.grid_position.x != r.grid_position.x ||
+            l.grid_position.y != r.grid_position.y ||
+            l.color != r.color || l.length != r.length) {
+            return false;
+        }
+    }
+
+    for (size_t i=0; i<left.counts.glyphs; ++i) {
+        const glyph_data &l = left.glyphs[i];
+        const glyph_data &r = right.glyphs[i];
+
+        if (l.grid_position.x != r.grid_position.x ||
+            l.grid_position.y != r.grid_position.y ||
+            l.cell_width != r.cell_width ||
+            l.rect.size.x != r.rect.size.x ||
+            l.rect.size.y != r.rect.size.y ||
+            l.rect.position.x != r.rect.position.x ||
+            l.rect.position.y != r.rect.position.y) {
+            return false;
+        }
+    }
+
+    for (size_t i=0; i<left.counts.lines; ++i) {
+        const line_data &l = left.lines[i];
+        const line_data &r = right.lines[i];
+
+        if (l.grid_position.x != r.grid_position.x ||
+            l.grid_position.y != r.grid_position.y ||
+            l.color != r.color || l.count != r.count) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+@interface testFrameBuilder : XCTestCase
+@end
+
+@implementation testFrameBuilder {
+    nvim::ui_controller *ui;
+    redraw_builder *redraw;
+    std::mt19937 *random;
+}
+
+// Large enough that rebuilt frames are split into multiple bands.
+static constexpr long width = 160;
+static constexpr long height = 80;
+
+- (void)setUp {
+    [super setUp];
+    [self setContinueAfterFailure:NO];
+
+    ui = new nvim::ui_controller();
+    redraw = new redraw_builder();
+    random = new std::mt19937(7);
+    glyph_cache.clear();
+
+    redraw->event("hl_attr_define", {
+        redraw->integer(1),
+        redraw->map({{redraw->string("foreground"), redraw->integer(0x112233)}})
+    });
+
+    redraw->event("hl_attr_define", {
+        redraw->integer(2),
+        redraw->map({{redraw->string("undercurl"), msg::boolean(true)}})
+    });
+
+    redraw->event("hl_attr_define", {
+        redraw->integer(3),
+        redraw->map({{redraw->string("underline"), msg::boolean(true)},
+                     {redraw->string("strikethrough"), msg::boolean(true)},
+                     {redraw->string("background"), redraw->integer(0x334455)}})
+    });
+
+    redraw->event("grid_resize", {
+        redraw->integer(1), redraw->integer(width), redraw->integer(height)
+    });
+
+    for (long row=0; row<height; ++row) {
+        [self writeRandomLine:row];
+    }
+
+    redraw->flush(*ui);
+}
+
+- (void)tearDown {
+    delete ui;
+    delete redraw;
+    delete random;
+    [super tearDown];
+}
+
+- (void)writeRandomLine:(long)row {
+    std::vector<msg::object> cells;
+
+    for (long col=0; col<width;) {
+        long repeat = std::min<long>(1 + (*random)() % 6, width - col);
+        char c = (*random)() % 4 ? 'a' + (*random)() % 26 : ' ';
+        long hlid = (*random)() % 4;
+
+        cells.push_back(redraw->array({redraw->string(std::string(1, c)),
+                                       redraw->integer(hlid),
+                                       redraw->integer(repeat)}));
+        col += repeat;
+    }
+
+    redraw->event("grid_line", {
+        redraw->integer(1), redraw->integer(row), redraw->integer(0),
+        redraw->array(std::move(cells))
+    });
+}
+
+- (void)scrollTop:(long)top bottom:(long)bottom left:(long)left right:(long)right rows:(long)rows {
+    redraw->event("grid_scroll", {
+        redraw->integer(1),
+        redraw->integer(top), redraw->integer(bottom),
+        redraw->integer(left), redraw->integer(right),
+        redraw->integer(rows), redraw->integer(0)
+    });
+}
+
+- (void)assertReusedFrameMatchesRebuiltFrame:(frame_builder&)reused {
+    const nvim::grid *grid = ui->get_global_grid();
+    reused.set_grid(grid);
+    test_frame reusedFrame = build_frame(reused);
+
+    frame_builder rebuilt;
+    rebuilt.set_grid(grid);
+    test_frame rebuiltFrame = build_frame(rebuilt);
+
+    XCTAssertTrue(same_frame(reusedFrame, rebuiltFrame));
+}
+
+- (void)testReusedRowsMatchRebuiltFrames {
+    frame_builder builder;
+    builder.set_grid(ui->get_global_grid());
+    build_frame(builder);
+
+    for (int i=0; i<40; ++i) {
+        long rows = (long)((*random)() % 5) - 2;
+
+        switch (i % 5) {
+            case 0:
+                [self writeRandomLine:(*random)() % height];
+                break;
+
+            case 1:
+                [self scrollTop:2 bottom:height - 3 left:0 right:width rows:rows];
+                break;
+
+            case 2:
+                redraw->event("grid_cursor_goto", {
+                    redraw->integer(1),
+                    redraw->integer((*random)() % height),
+                    redraw->integer((*random)() % width)
+                });
+                break;
+
+            case 3:
+                [self scrollTop:0 bottom:height left:3 right:width - 3 rows:1];
+                break;
+
+            case 4:
+                redraw->event("hl_attr_define", {
+                    redraw->integer(1),
+                    redraw->map({{redraw->string("foreground"),
+                                  redraw->integer((*random)() & 0xFFFFFF)}})
+                });
+                break;
+        }
+
+        redraw->flush(*ui);
+        [self assertReusedFrameMatchesRebuiltFrame:builder];
+    }
+}
+
+- (void)testBackgroundSpansCoverGrid {
+    frame_builder builder;
+    builder.set_grid(ui->get_global_grid());
+    test_frame frame = build_frame(builder);
+
+    XCTAssertGreaterThanOrEqual(frame.counts.backgrounds, (size_t)height);
+    XCTAssertLessThan(frame.counts.backgrounds, (size_t)(width * height));
+
+    long row = 0;
+    long col = 0;
+
+    for (size_t i=0; i<frame.counts.backgrounds; ++i) {
+        const background_data &span = frame.backgrounds[i];
+
+        if (col == width) {
+            row += 1;
+            col = 0;
+        } else if (col != 0) {
+            XCTAssertNotEqual(span.color, frame.backgrounds[i - 1].color);
+        }
+
+        XCTAssertEqual(span.grid_position.y, row);
+        XCTAssertEqual(span.grid_position.x, col);
+        XCTAssertGreaterThan(span.length, 0);
+        col += span.length;
+    }
+
+    XCTAssertEqual(row, height - 1);
+    XCTAssertEqual(col, width);
+}
+
+- (void)testUnchangedFrameOnlyRebuildsCursorRow {
+    frame_builder builder;
+    builder.set_grid(ui->get_global_grid());
+    build_frame(builder);
+
+    build_frame(builder);
+    XCTAssertLessThanOrEqual(finds.load(), width);
+}
+
+- (void)testGlyphGenerationInvalidatesRows {
+    frame_builder builder;
+    builder.set_grid(ui->get_global_grid());
+    test_frame first = build_frame(builder);
+
+    build_frame(builder, 1);
+    XCTAssertEqual(finds.load(), first.counts.glyphs);
+}
+
+- (void)testCachedGlyphsAreNotLookedUp {
+    frame_builder builder;
+    builder.set_grid(ui->get_global_grid());
+    test_frame first = build_frame(builder);
+    XCTAssertGreaterThan(lookups, 0);
+
+    frame_builder rebuilt;
+    rebuilt.set_grid(ui->get_global_grid());
+    test_frame second = build_frame(rebuilt);
+
+    XCTAssertEqual(finds.load(), second.counts.glyphs);
+    XCTAssertEqual(lookups, 0);
+    XCTAssertTrue(same_frame(first, second));
+}
+
+- (void)testRebuiltFramePerformance {
+    const nvim::grid *grid = ui->get_global_grid();
+
+    // Warm the glyph cache, so we only measure building the frame.
+    frame_builder warm;
+    warm.set_grid(grid);
+    build_frame(warm);
+
+    [self measureBlock:^{
+        frame_builder builder;
+        builder.set_grid(grid);
+        build_frame(builder);
+    }];
+}
+
+- (void)testScrolledFramePerformance {
+    // Blocks capture C++ objects by const copy, so we capture a pointer.
+    frame_builder scrolled;
+    frame_builder *builder = &scrolled;
+    builder->set_grid(ui->get_global_grid());
+    build_frame(*builder);
+
+    [self measureBlock:^{
+        for (int i=0; i<10; ++i) {
+            [self scrollTop:0 bottom:height left:0 right:width rows:1];
+            [self writeRandomLine:height - 1];
+            self->redraw->flush(*self->ui);
+
+            builder->set_grid(self->ui->get_global_grid());
+            build_frame(*builder);
+        }
+    }];
+}
+
+@end
@@ -0,0 +1,136 @@
+//
+//  Neovim Mac Test
+//  InlineFunction.mm
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <XCTest/XCTest.h>
+#include <memory>
+#include "inline_function.hpp"
+
+using function = inline_function<int(int), 32>;
+
+@interface testInlineFunction : XCTestCase
+@end
+
+@implementation testInlineFunction
+
+- (void)testDefaultConstructor {
+    function fn;
+    XCTAssertFalse(fn);
+}
+
+- (void)testNullptrConstructor {
+    function fn(nullptr);
+    XCTAssertFalse(fn);
+}
+
+- (void)testInvoke {
+    int base = 10;
+    function fn = [base](int x) { return base + x; };
+
+    XCTAssertTrue(fn);
+    XCTAssertEqual(fn(5), 15);
+}
+
+- (void)testMutableState {
+    function fn = [count = 0](int x) mutable { return count += x; };
+
+    XCTAssertEqual(fn(1), 1);
+    XCTAssertEqual(fn(2), 3);
+    XCTAssertEqual(fn(3), 6);
+}
+
+- (void)testSmallCallablesAreInline {
+    auto small = [ptr = (void*)nullptr](int x) { return x; };
+    XCTAssertTrue(function::stores_inline<decltype(small)>());
+}
+
+- (void)testLargeCallablesAreOnHeap {
+    char buffer[64] = {};
+    auto large = [buffer](int x) { return x + buffer[0]; };
+    XCTAssertFalse(function::stores_inline<decltype(large)>());
+
+    function fn = large;
+    XCTAssertEqual(fn(4), 4);
+}
+
+- (void)testMoveOnlyCallable {
+    auto ptr = std::make_unique<int>(42);
+    function fn = [ptr = std::move(ptr)](int x) { return *ptr + x; };
+
+    XCTAssertEqual(fn(1), 43);
+}
+
+- (void)testMoveConstructor {
+    auto shared = std::make_shared<int>(2);
+    function fn = [shared](int x) { return *shared * x; };
+    function moved(std::move(fn));
+
+    XCTAssertFalse(fn);
+    XCTAssertTrue(moved);
+    XCTAssertEqual(moved(3), 6);
+    XCTAssertEqual(shared.use_count(), 2);
+}
+
+- (void)testMoveAssignment {
+    auto first = std::make_shared<int>(1);
+    auto second = std::make_shared<int>(2);
+
+    function fn = [first](int x) { return *first + x; };
+    function other = [second](int x) { return *second + x; };
+
+    fn = std::move(other);
+
+    XCTAssertFalse(other);
+    XCTAssertEqual(fn(1), 3);
+    XCTAssertEqual(first.use_count(), 1);
+    XCTAssertEqual(second.use_count(), 2);
+}
+
+- (void)testHeapMoveConstructor {
+    char buffer[64] = {1};
+    function fn = [buffer](int x) { return x + buffer[0]; };
+    function moved(std::move(fn));
+
+    XCTAssertFalse(fn);
+    XCTAssertEqual(moved(1), 2);
+}
+
+- (void)testNullptrAssignmentDestroys {
+    auto shared = std::make_shared<int>(0);
+    function fn = [shared](int x) { return x; };
+    XCTAssertEqual(shared.use_count(), 2);
+
+    fn = nullptr;
+    XCTAssertFalse(fn);
+    XCTAssertEqual(shared.use_count(), 1);
+}
+
+- (void)testDestructorDestroys {
+    auto shared = std::make_shared<int>(0);
+
+    {
+        function fn = [shared](int x) { return x; };
+        XCTAssertEqual(shared.use_count(), 2);
+    }
+
+    XCTAssertEqual(shared.use_count(), 1);
+}
+
+- (void)testHeapDestructorDestroys {
+    auto shared = std::make_shared<int>(0);
+
+    {
+        char buffer[64] = {};
+        function fn = [shared, buffer](int x) { return x + buffer[0]; };
+        XCTAssertEqual(shared.use_count(), 2);
+    }
+
+    XCTAssertEqual(shared.use_count(), 1);
+}
+
+@end
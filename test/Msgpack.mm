@@ -1711,4 +1711,22 @@ static inline bool all_a(const char *begin, const char *end) {
     XCTAssertEqual(msg::string(packer.data(), packer.size()), packed);
 }
 
+- (void)testPackedSize {
+    auto packed = packed_data("\xc0\xc3\x05\xe0\xcc\xff\xd0\x80\xcd\x01\xb0"
+                              "\xd2\x80\x00\x00\x00\xcf\x00\x00\x00\x01\x00"
+                              "\x00\x00\x00\xcb\x40\x09\x1e\xb8\x51\xeb\x85"
+                              "\x1f\xa3\x61\x62\x63\xc4\x00\xd4\x01\x02\x94"
+                              "\x01\x02\x03\x04\x81\xa1\x30\x00");
+
+    msg::unpacker unpacker;
+    unpacker.feed(packed.data(), packed.size());
+    size_t size = 0;
+
+    while (msg::object *obj = unpacker.unpack()) {
+        size += msg::packed_size(*obj);
+    }
+
+    XCTAssertEqual(size, packed.size());
+}
+
 @end